@@ -0,0 +1,43 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include "arena.h"
+
+Arena::Arena(void) : next(NULL), left(0), used(0) {}
+
+Arena::~Arena() {
+	// Objects are destroyed in the reverse order of their creation, as members of a class are
+	for (size_t i = finalizers.size(); i > 0; i--)
+		finalizers[i - 1].destroy(finalizers[i - 1].obj);
+
+	for (char* block : blocks)
+		free(block);
+}
+
+void* Arena::Allocate(size_t size, size_t alignment) {
+	size_t padding = (alignment - (uintptr_t)next % alignment) % alignment;
+
+	if (next == NULL || padding + size > left) {
+		// Larger objects get a block of their own, so the current block keeps its free space
+		size_t block_size = size + alignment > ARENA_BLOCK_SIZE ? size + alignment : ARENA_BLOCK_SIZE;
+		char* block = (char*)malloc(block_size);
+
+		if (block == NULL)
+			throw bad_alloc();
+
+		blocks.push_back(block);
+		if (block_size > ARENA_BLOCK_SIZE) {
+			used += size;
+			return block + (alignment - (uintptr_t)block % alignment) % alignment;
+		}
+
+		next = block;
+		left = block_size;
+		padding = (alignment - (uintptr_t)next % alignment) % alignment;
+	}
+
+	void* p = next + padding;
+	next += padding + size;
+	left -= padding + size;
+	used += size;
+	return p;
+}
@@ -0,0 +1,51 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <vector>
+
+using namespace std;
+
+#define ARENA_BLOCK_SIZE (1 << 20) // bytes taken from the system at a time
+
+// Memory of the data owned by a scene. Objects are placed one after the other, in the order they are created,
+// in large blocks that are all released at once with the arena. Only the types that need a destructor are
+// remembered, so that it runs then (most primitives do not)
+class Arena
+{
+public:
+	Arena(void);
+	~Arena();
+
+	template <class T, class... Args>
+	T* New(Args&&... args) {
+		T* obj = new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+
+		if (!is_trivially_destructible<T>::value)
+			finalizers.push_back(Finalizer{ obj, [](void* p) { static_cast<T*>(p)->~T(); } });
+		return obj;
+	}
+
+	void* Allocate(size_t size, size_t alignment);
+	size_t getSize() { return used; }  // bytes handed out
+
+private:
+	struct Finalizer {
+		void* obj;
+		void (*destroy)(void*);
+	};
+
+	vector<char*> blocks;
+	char* next;			// free space of the last block
+	size_t left;
+	size_t used;
+	vector<Finalizer> finalizers;
+
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+};
+
+#endif
@@ -48,6 +48,12 @@ Vector AABB::centroid(void) {
 	return (min + max) / 2;
 }
 
+// --------------------------------------------------------------------- surface area
+float AABB::area(void) const {
+	Vector d = max - min;
+	return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
 // --------------------------------------------------------------------- extend AABB
 void AABB::extend(AABB box) {
 	if (min.x > box.min.x) min.x = box.min.x;
@@ -59,67 +65,39 @@ void AABB::extend(AABB box) {
 	if (max.z < box.max.z) max.z = box.max.z;
 }
 
+// --------------------------------------------------------------------- clip AABB
+void AABB::clip(AABB box) {
+	if (min.x < box.min.x) min.x = box.min.x;
+	if (min.y < box.min.y) min.y = box.min.y;
+	if (min.z < box.min.z) min.z = box.min.z;
+
+	if (max.x > box.max.x) max.x = box.max.x;
+	if (max.y > box.max.y) max.y = box.max.y;
+	if (max.z > box.max.z) max.z = box.max.z;
+}
+
 // --------------------------------------------------------------------- AABB intersection
 
-bool AABB::intercepts(const Ray& ray, float& t)
+bool AABB::intercepts(const Ray& ray, float& t, float t_max)
 {
-	double t0, t1;
-
-	float ox = ray.origin.x;
-	float oy = ray.origin.y;
-	float oz = ray.origin.z;
-	float dx = ray.direction.x;
-	float dy = ray.direction.y;
-	float dz = ray.direction.z;
-
-	float x0 = min.x;
-	float y0 = min.y;
-	float z0 = min.z;
-	float x1 = max.x;
-	float y1 = max.y;
-	float z1 = max.z;
-
-	float tx_min, ty_min, tz_min;
-	float tx_max, ty_max, tz_max;
-
-	float a = 1.0 / dx;
-	if (a >= 0) {
-		tx_min = (x0 - ox) * a;
-		tx_max = (x1 - ox) * a;
-	}
-	else {
-		tx_min = (x1 - ox) * a;
-		tx_max = (x0 - ox) * a;
-	}
-
-	float b = 1.0 / dy;
-	if (b >= 0) {
-		ty_min = (y0 - oy) * b;
-		ty_max = (y1 - oy) * b;
-	}
-	else {
-		ty_min = (y1 - oy) * b;
-		ty_max = (y0 - oy) * b;
-	}
-
-	float c = 1.0 / dz;
-	if (c >= 0) {
-		tz_min = (z0 - oz) * c;
-		tz_max = (z1 - oz) * c;
-	}
-	else {
-		tz_min = (z1 - oz) * c;
-		tz_max = (z0 - oz) * c;
-	}
+	// The sign of the direction tells which side of each slab is entered first
+	const Vector* bounds[2] = { &min, &max };
+
+	float tx_min = (bounds[ray.sign[0]]->x - ray.origin.x) * ray.inv_dir.x;
+	float tx_max = (bounds[1 - ray.sign[0]]->x - ray.origin.x) * ray.inv_dir.x;
+	float ty_min = (bounds[ray.sign[1]]->y - ray.origin.y) * ray.inv_dir.y;
+	float ty_max = (bounds[1 - ray.sign[1]]->y - ray.origin.y) * ray.inv_dir.y;
+	float tz_min = (bounds[ray.sign[2]]->z - ray.origin.z) * ray.inv_dir.z;
+	float tz_max = (bounds[1 - ray.sign[2]]->z - ray.origin.z) * ray.inv_dir.z;
 
 	//largest entering t value
-	t0 = MAX3(tx_min, ty_min, tz_min);
+	float t0 = MAX3(tx_min, ty_min, tz_min);
 
 	//smallest exiting t value
-	t1 = MIN3(tx_max, ty_max, tz_max);
+	float t1 = MIN3(tx_max, ty_max, tz_max);
 
 	t = (t0 < 0) ? t1 : t0;
 
-	return (t0 < t1 && t1 > 0);
+	return (t0 < t1 && t1 > ray.tmin && t0 < t_max);
 }
 #endif
\ No newline at end of file
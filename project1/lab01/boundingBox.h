@@ -14,8 +14,11 @@ public:
 	AABB operator= (const AABB& rhs);
 	
 	bool isInside(const Vector& p);
-	bool intercepts(const Ray& r, float& t);
+	bool intercepts(const Ray& r, float& t) { return intercepts(r, t, r.tmax); }
+	bool intercepts(const Ray& r, float& t, float t_max);	// misses the box if it is entered beyond t_max (e.g. the closest hit so far)
 	Vector centroid(void);
+	float area(void) const;
 	void extend(AABB box);
+	void clip(AABB box);	// shrinks the box to its intersection with another one (empty if min > max along an axis)
 
 };
\ No newline at end of file
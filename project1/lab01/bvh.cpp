@@ -1,7 +1,12 @@
 #include <algorithm>
+#include <future>
 #include "rayAccelerator.h"
 #include "macros.h"
 
+#ifdef USE_SSE
+#include <xmmintrin.h>
+#endif
+
 using namespace std;
 
 int max_axis = 0;
@@ -25,10 +30,24 @@ void BVH::BVHNode::makeNode(unsigned int left_index_) {
 
 BVH::BVH(void) {}
 
+BVH::~BVH() {
+	for (BVHNode* node : nodes)
+		delete node;
+}
+
+thread_local stack<BVH::StackItem> BVH::hit_stack;
+thread_local stack<BVH::PacketItem> BVH::packet_stack;
+
 int BVH::getNumObjects() { return objects.size(); }
 
 void BVH::Build(vector<Object *> &objs) {
 
+	// Built again from scratch (e.g. for moving objects)
+	for (BVHNode* node : nodes)
+		delete node;
+	nodes.clear();
+	objects.clear();
+
 	BVHNode *root = new BVHNode();
 
 	Vector min = Vector(FLT_MAX, FLT_MAX, FLT_MAX), max = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
@@ -46,7 +65,476 @@ void BVH::Build(vector<Object *> &objs) {
 	root->setAABB(world_bbox);
 	nodes.push_back(root);
 
-	build_recursive(0, objects.size(), root); // -> root node takes all the 
+	// Spatial splits bound the objects by their parts in the nodes, which a refit at shutter close would undo
+	if (spatial_budget > 0 && shutter == 0) {
+		vector<Reference> refs;
+
+		for (Object* obj : objects)
+			refs.push_back(Reference(obj, obj->GetBoundingBox()));
+
+		spatial_refs_left = (int)(spatial_budget * objects.size());
+		root_area = world_bbox.area();
+		objects.clear();
+		build_spatial(refs, root);
+	}
+	else
+		build_recursive(0, objects.size(), root); // -> root node takes all the 
+
+	// The tree is split on the bounds at shutter open; a refit adds the bounds at shutter close
+	if (shutter > 0)
+		Refit();
+
+	build_cost = Cost();
+}
+
+// The tree is kept, so it gets worse as the objects move away from where they were when it was built; Cost() tells how much
+void BVH::Refit() {
+	if (nodes.empty())
+		return;
+
+	refit_recursive(nodes[0], objects.size() >= REFIT_PARALLEL_MIN ? REFIT_PARALLEL_DEPTH : 0);
+
+	AABB& world_bbox = nodes[0]->getAABB();
+	world_bbox.min.x -= EPSILON; world_bbox.min.y -= EPSILON; world_bbox.min.z -= EPSILON;
+	world_bbox.max.x += EPSILON; world_bbox.max.y += EPSILON; world_bbox.max.z += EPSILON;
+
+	AABB& close_bbox = nodes[0]->getCloseAABB();
+	close_bbox.min.x -= EPSILON; close_bbox.min.y -= EPSILON; close_bbox.min.z -= EPSILON;
+	close_bbox.max.x += EPSILON; close_bbox.max.y += EPSILON; close_bbox.max.z += EPSILON;
+}
+
+// Bounds of the node from its objects, or from its children once they are refitted. Down to parallel_depth levels
+// below, the left child is refitted on another thread while this one refits the right child
+void BVH::refit_recursive(BVHNode* node, int parallel_depth) {
+	AABB bbox = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+	AABB close_bbox = bbox;
+
+	if (node->isLeaf()) {
+		int base_index = node->getIndex(), size = node->getNObjs();
+
+		for (int i = base_index; i < base_index + size; i++) {
+			bbox.extend(objects[i]->GetBoundingBox());
+			if (shutter > 0)
+				close_bbox.extend(objects[i]->GetBoundingBox(shutter));
+		}
+	}
+	else {
+		BVHNode* left = nodes[node->getIndex()];
+		BVHNode* right = nodes[node->getIndex() + 1];
+
+		if (parallel_depth > 0) {
+			future<void> left_done = async(launch::async, &BVH::refit_recursive, this, left, parallel_depth - 1);
+
+			refit_recursive(right, parallel_depth - 1);
+			left_done.get();
+		}
+		else {
+			refit_recursive(left, 0);
+			refit_recursive(right, 0);
+		}
+
+		bbox.extend(left->getAABB());
+		bbox.extend(right->getAABB());
+		close_bbox.extend(left->getCloseAABB());
+		close_bbox.extend(right->getCloseAABB());
+	}
+
+	node->setAABB(bbox);
+	node->setCloseAABB(close_bbox);
+}
+
+// Tree rotations (Kensler): each node swaps one of its children with a grandchild on the other side, or two grandchildren
+// across, if that shrinks its children. Passes go bottom-up over the tree, spread over threads as Refit does, until one
+// gains less than OPTIMIZE_MIN_GAIN or the time is up. The leaves are kept, so the tree is as valid after any rotation
+int BVH::Optimize(float seconds) {
+	if (nodes.size() < 3)
+		return 0;
+
+	auto deadline = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<float>(seconds));
+	int parallel_depth = objects.size() >= REFIT_PARALLEL_MIN ? REFIT_PARALLEL_DEPTH : 0;
+	int rotations = 0;
+	float cost = Cost();
+
+	while (chrono::steady_clock::now() < deadline) {
+		int pass = rotate_recursive(nodes[0], parallel_depth, deadline);
+		float new_cost = Cost();
+
+		rotations += pass;
+		if (pass == 0 || new_cost > cost * (1 - OPTIMIZE_MIN_GAIN))
+			break;
+		cost = new_cost;
+	}
+
+	// The rotations were chosen on the bounds at shutter open
+	if (shutter > 0)
+		Refit();
+
+	build_cost = Cost();
+	return rotations;
+}
+
+// The subtrees of the children are done first: a rotation only moves nodes below the node, so the threads never meet
+int BVH::rotate_recursive(BVHNode* node, int parallel_depth, chrono::steady_clock::time_point deadline) {
+	if (node->isLeaf())
+		return 0;
+
+	BVHNode* left = nodes[node->getIndex()];
+	BVHNode* right = nodes[node->getIndex() + 1];
+	int rotations;
+
+	if (parallel_depth > 0) {
+		future<int> left_done = async(launch::async, &BVH::rotate_recursive, this, left, parallel_depth - 1, deadline);
+
+		rotations = rotate_recursive(right, parallel_depth - 1, deadline);
+		rotations += left_done.get();
+	}
+	else
+		rotations = rotate_recursive(left, 0, deadline) + rotate_recursive(right, 0, deadline);
+
+	if (chrono::steady_clock::now() >= deadline)
+		return rotations;
+
+	return rotations + rotate(node);
+}
+
+// Best rotation below the node, by the area it takes off the children (the node and everything below the swapped
+// nodes keep their bounds, so that is the SAH gain over SAH_TRAVERSAL_COST). Returns 1 if it was made
+int BVH::rotate(BVHNode* node) {
+	unsigned int l = node->getIndex();
+	float best_gain = 0;
+	unsigned int a = 0, b = 0;	// slots of the nodes to swap
+
+	// A child with a grandchild on the other side: only the box of the other child changes
+	for (unsigned int side = 0; side < 2; side++) {
+		BVHNode* child = nodes[l + side];
+		BVHNode* other = nodes[l + 1 - side];
+
+		if (other->isLeaf())
+			continue;
+
+		unsigned int g = other->getIndex();
+		for (unsigned int k = 0; k < 2; k++) {
+			AABB box = child->getAABB();
+			box.extend(nodes[g + 1 - k]->getAABB());
+
+			float gain = other->getAABB().area() - box.area();
+			if (gain > best_gain) {
+				best_gain = gain;
+				a = l + side;
+				b = g + k;
+			}
+		}
+	}
+
+	// A grandchild with one on the other side: both children change
+	if (!nodes[l]->isLeaf() && !nodes[l + 1]->isLeaf()) {
+		unsigned int gl = nodes[l]->getIndex(), gr = nodes[l + 1]->getIndex();
+		float area = nodes[l]->getAABB().area() + nodes[l + 1]->getAABB().area();
+
+		for (unsigned int i = 0; i < 2; i++) {
+			for (unsigned int j = 0; j < 2; j++) {
+				AABB left_box = nodes[gr + j]->getAABB(), right_box = nodes[gl + i]->getAABB();
+				left_box.extend(nodes[gl + 1 - i]->getAABB());
+				right_box.extend(nodes[gr + 1 - j]->getAABB());
+
+				float gain = area - left_box.area() - right_box.area();
+				if (gain > best_gain) {
+					best_gain = gain;
+					a = gl + i;
+					b = gr + j;
+				}
+			}
+		}
+	}
+
+	if (best_gain <= 0)
+		return 0;
+
+	// The nodes are referred to by their slots, so swapping the slots moves the subtrees
+	swap(nodes[a], nodes[b]);
+
+	for (unsigned int s = l; s < l + 2; s++) {
+		BVHNode* child = nodes[s];
+
+		if (!child->isLeaf()) {
+			AABB box = nodes[child->getIndex()]->getAABB();
+			box.extend(nodes[child->getIndex() + 1]->getAABB());
+			child->setAABB(box);
+		}
+	}
+
+	return 1;
+}
+
+// Bounds of the node at the time of a ray. The objects move linearly, so the box interpolated between shutter open and
+// close still holds them: motion blur costs no rebuild, whatever the number of time samples
+AABB& BVH::nodeBounds(BVHNode* node, float time, AABB& moving_bbox) {
+	if (shutter == 0)
+		return node->getAABB();
+
+	AABB& open = node->getAABB();
+	AABB& close = node->getCloseAABB();
+	float s = time / shutter;
+
+	moving_bbox.min = open.min + (close.min - open.min) * s;
+	moving_bbox.max = open.max + (close.max - open.max) * s;
+	return moving_bbox;
+}
+
+// Sum over the nodes of the probability of a ray through the root hitting the node (ratio of surface areas) times the
+// cost of the node: SAH_TRAVERSAL_COST for an interior node, one intersection test per object for a leaf
+float BVH::Cost() {
+	if (nodes.empty())
+		return 0;
+
+	float root_area = nodes[0]->getAABB().area();
+	float cost = 0;
+
+	if (root_area <= 0)
+		return 0;
+
+	for (BVHNode* node : nodes) {
+		float p = node->getAABB().area() / root_area;
+
+		cost += p * (node->isLeaf() ? node->getNObjs() : SAH_TRAVERSAL_COST);
+	}
+
+	return cost;
+}
+
+// Node overlap: a ray through the shared part of two siblings visits both
+float BVH::Overlap() {
+	if (nodes.empty() || nodes[0]->getAABB().area() <= 0)
+		return 0;
+
+	float overlap = 0;
+
+	for (BVHNode* node : nodes) {
+		if (node->isLeaf())
+			continue;
+
+		AABB shared = nodes[node->getIndex()]->getAABB();
+		shared.clip(nodes[node->getIndex() + 1]->getAABB());
+		if (shared.min.x <= shared.max.x && shared.min.y <= shared.max.y && shared.min.z <= shared.max.z)
+			overlap += shared.area();
+	}
+
+	return overlap / nodes[0]->getAABB().area();
+}
+
+// Spatial split BVH (SBVH): each node takes the best SAH split of its references, either by their centroids as
+// build_recursive does, or by a plane that cuts the references crossing it in two (one more reference). The latter is
+// only tried where the children of the object split would overlap, and while the budget of references lasts
+void BVH::build_spatial(vector<Reference>& refs, BVHNode* node) {
+	int n = refs.size();
+
+	if (n <= Threshold) {
+		node->makeLeaf(objects.size(), n);
+		for (Reference& ref : refs)
+			objects.push_back(ref.obj);
+		return;
+	}
+
+	int axis, split_index, spatial_axis;
+	float plane;
+	float cost = objectSplit(refs, axis, split_index);
+
+	vector<Reference> left, right;
+	AABB left_box = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+	AABB right_box = left_box;
+
+	// Sorted along the best axis: the children of the object split, and how much they overlap
+	std::sort(refs.begin(), refs.end(), [axis](const Reference& a, const Reference& b) {
+		return a.bbox.min.getAxisValue(axis) + a.bbox.max.getAxisValue(axis) < b.bbox.min.getAxisValue(axis) + b.bbox.max.getAxisValue(axis);
+	});
+	for (int i = 0; i < n; i++)
+		(i < split_index ? left_box : right_box).extend(refs[i].bbox);
+
+	AABB shared = left_box;
+	shared.clip(right_box);
+	bool overlap = shared.min.x < shared.max.x && shared.min.y < shared.max.y && shared.min.z < shared.max.z;
+
+	if (spatial_refs_left > 0 && overlap && shared.area() > SBVH_OVERLAP_ALPHA * root_area &&
+		spatialSplit(refs, node->getAABB(), spatial_axis, plane) < cost) {
+		axis = spatial_axis;
+
+		left_box = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+		right_box = left_box;
+
+		// Bounds and counts of the references wholly on each side
+		vector<Reference> crossing;
+		for (Reference& ref : refs) {
+			if (ref.bbox.max.getAxisValue(axis) <= plane) { left.push_back(ref); left_box.extend(ref.bbox); }
+			else if (ref.bbox.min.getAxisValue(axis) >= plane) { right.push_back(ref); right_box.extend(ref.bbox); }
+			else crossing.push_back(ref);
+		}
+
+		// A crossing reference is cut in two, unless it costs less to leave it whole on one side (reference unsplitting)
+		for (Reference& ref : crossing) {
+			AABB left_part = ref.bbox, right_part = ref.bbox;
+			left_part.max.setAxisValue(axis, plane);
+			right_part.min.setAxisValue(axis, plane);
+			left_part = ref.obj->GetClippedBoundingBox(left_part);
+			right_part = ref.obj->GetClippedBoundingBox(right_part);
+
+			AABB left_whole = left_box, right_whole = right_box, left_cut = left_box, right_cut = right_box;
+			left_whole.extend(ref.bbox); right_whole.extend(ref.bbox);
+			left_cut.extend(left_part); right_cut.extend(right_part);
+
+			int nl = left.size(), nr = right.size();
+			float cost_cut = left_cut.area() * (nl + 1) + right_cut.area() * (nr + 1);
+			float cost_left = left_whole.area() * (nl + 1) + (nr > 0 ? right_box.area() * nr : 0);
+			float cost_right = (nl > 0 ? left_box.area() * nl : 0) + right_whole.area() * (nr + 1);
+
+			if (cost_left <= cost_cut && cost_left <= cost_right) {
+				left.push_back(ref); left_box = left_whole;
+			}
+			else if (cost_right <= cost_cut) {
+				right.push_back(ref); right_box = right_whole;
+			}
+			else {
+				left.push_back(Reference(ref.obj, left_part)); left_box = left_cut;
+				right.push_back(Reference(ref.obj, right_part)); right_box = right_cut;
+			}
+		}
+
+		// The split must leave fewer references on each side, or the recursion might not end
+		int added = left.size() + right.size() - n;
+
+		if (left.size() < (size_t)n && right.size() < (size_t)n && added <= spatial_refs_left)
+			spatial_refs_left -= added;
+		else {
+			left.clear(); right.clear();
+		}
+	}
+
+	if (left.empty()) {
+		left_box = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+		right_box = left_box;
+
+		for (int i = 0; i < n; i++) {
+			(i < split_index ? left : right).push_back(refs[i]);
+			(i < split_index ? left_box : right_box).extend(refs[i].bbox);
+		}
+	}
+
+	// The references of the node are no longer needed down the tree
+	vector<Reference>().swap(refs);
+
+	BVHNode* left_child = new BVHNode();
+	BVHNode* right_child = new BVHNode();
+
+	node->makeNode(nodes.size());
+	left_child->setAABB(left_box);
+	right_child->setAABB(right_box);
+	nodes.push_back(left_child);
+	nodes.push_back(right_child);
+
+	build_spatial(left, left_child);
+	build_spatial(right, right_child);
+}
+
+// Best SAH split of the references by their centroids, along any axis: area(left) * n_left + area(right) * n_right,
+// with the first best_index references (sorted along best_axis) on the left
+float BVH::objectSplit(vector<Reference>& refs, int& best_axis, int& best_index) {
+	int n = refs.size();
+	float best_cost = FLT_MAX;
+	vector<float> right_area(n);
+
+	best_axis = 0;
+	best_index = n / 2;
+
+	for (int axis = 0; axis < 3; axis++) {
+		std::sort(refs.begin(), refs.end(), [axis](const Reference& a, const Reference& b) {
+			return a.bbox.min.getAxisValue(axis) + a.bbox.max.getAxisValue(axis) < b.bbox.min.getAxisValue(axis) + b.bbox.max.getAxisValue(axis);
+		});
+
+		AABB bbox = refs[n - 1].bbox;
+		for (int i = n - 1; i > 0; i--) {
+			bbox.extend(refs[i].bbox);
+			right_area[i] = bbox.area();
+		}
+
+		bbox = refs[0].bbox;
+		for (int i = 1; i < n; i++) {
+			float cost = bbox.area() * i + right_area[i] * (n - i);
+
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_axis = axis;
+				best_index = i;
+			}
+			bbox.extend(refs[i].bbox);
+		}
+	}
+
+	return best_cost;
+}
+
+// Best SAH split of the node box by a plane between SBVH_BINS bins along any axis. Each reference is clipped to the
+// bins it crosses: it counts on both sides of the planes within it
+float BVH::spatialSplit(vector<Reference>& refs, AABB& bbox, int& best_axis, float& best_plane) {
+	float best_cost = FLT_MAX;
+
+	for (int axis = 0; axis < 3; axis++) {
+		float lo = bbox.min.getAxisValue(axis), width = (bbox.max.getAxisValue(axis) - lo) / SBVH_BINS;
+
+		if (width <= 0)
+			continue;
+
+		AABB bins[SBVH_BINS];
+		int entries[SBVH_BINS] = { 0 }, exits[SBVH_BINS] = { 0 };
+
+		for (int b = 0; b < SBVH_BINS; b++)
+			bins[b] = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+
+		for (Reference& ref : refs) {
+			float ref_min = ref.bbox.min.getAxisValue(axis), ref_max = ref.bbox.max.getAxisValue(axis);
+			int first = MAX(0, MIN(SBVH_BINS - 1, (int)((ref_min - lo) / width)));
+			int last = MAX(first, MIN(SBVH_BINS - 1, (int)((ref_max - lo) / width)));
+
+			for (int b = first; b <= last; b++) {
+				AABB part = ref.bbox;
+
+				if (b > first) part.min.setAxisValue(axis, lo + b * width);
+				if (b < last) part.max.setAxisValue(axis, lo + (b + 1) * width);
+				bins[b].extend(first == last ? ref.bbox : ref.obj->GetClippedBoundingBox(part));
+			}
+			entries[first]++;
+			exits[last]++;
+		}
+
+		float right_area[SBVH_BINS];
+		int right_count[SBVH_BINS];
+		AABB right_box = bins[SBVH_BINS - 1];
+		int count = 0;
+
+		for (int b = SBVH_BINS - 1; b > 0; b--) {
+			right_box.extend(bins[b]);
+			count += exits[b];
+			right_area[b] = right_box.area();
+			right_count[b] = count;
+		}
+
+		AABB left_box = bins[0];
+		count = 0;
+		for (int b = 1; b < SBVH_BINS; b++) {
+			left_box.extend(bins[b - 1]);
+			count += entries[b - 1];
+
+			if (count == 0 || right_count[b] == 0)
+				continue;
+
+			float cost = left_box.area() * count + right_area[b] * right_count[b];
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_axis = axis;
+				best_plane = lo + b * width;
+			}
+		}
+	}
+
+	return best_cost;
 }
 
 void BVH::build_recursive(int left_index, int right_index, BVHNode *node) {
@@ -138,12 +626,14 @@ void BVH::build_recursive(int left_index, int right_index, BVHNode *node) {
 			
 }
 
-Object* BVH::findIntersection(Ray& ray, BVHNode* current_node, float* t_ret) {
+bool BVH::findIntersection(const Ray& ray, BVHNode* current_node, HitRecord& hit) {
 	float t;
-	Object* closest_obj = nullptr;
+	bool found = false;
+	AABB bbox1, bbox2;
+	size_t stack_base = hit_stack.size();	// the traversal of an instance's BVH nests in that of the scene BVH
 
-	if (!current_node->getAABB().intercepts(ray, t)) {
-		return nullptr;
+	if (!nodeBounds(current_node, ray.time, bbox1).intercepts(ray, t, hit.t)) {
+		return false;
 	}
 
 	while (true) {
@@ -153,12 +643,8 @@ Object* BVH::findIntersection(Ray& ray, BVHNode* current_node, float* t_ret) {
 			int base_index = current_node->getIndex(), size = current_node->getNObjs();
 
 			for (int i = base_index; i < base_index + size; i++) {
-				bool inter = objects[i]->intercepts(ray, t);
-
-				if (inter && t < *t_ret) {
-					*t_ret = t;
-					closest_obj = objects[i];
-				}
+				if (objects[i]->closestHit(ray, hit.t, hit))  //only hits closer than the closest so far
+					found = true;
 			}
 		}
 		else {
@@ -167,25 +653,26 @@ Object* BVH::findIntersection(Ray& ray, BVHNode* current_node, float* t_ret) {
 			BVHNode* child1 = nodes[current_node->getIndex()];
 			BVHNode* child2 = nodes[current_node->getIndex() + 1];
 
-			bool c1 = child1->getAABB().intercepts(ray, t1);// Test node�s children
-			bool c2 = child2->getAABB().intercepts(ray, t2);// Test node�s children
+			AABB& box1 = nodeBounds(child1, ray.time, bbox1);
+			AABB& box2 = nodeBounds(child2, ray.time, bbox2);
 
-			if (child1->getAABB().isInside(ray.origin)) t1 = 0;
-			if (child2->getAABB().isInside(ray.origin)) t2 = 0;
+			// Test node�s children: those entered beyond the closest hit so far are skipped
+			bool c1 = box1.intercepts(ray, t1, hit.t);
+			bool c2 = box2.intercepts(ray, t2, hit.t);
 
-			StackItem* s = nullptr;
+			if (box1.isInside(ray.origin)) t1 = 0;
+			if (box2.isInside(ray.origin)) t2 = 0;
 
 			if (c1 && c2) {
 				if (t2 < t1) {
 					current_node = child2;
-					s = new StackItem(child1, t1);
+					hit_stack.push(StackItem(child1, t1));
 				}
 				else {
 					current_node = child1;
-					s = new StackItem(child2, t2);
+					hit_stack.push(StackItem(child2, t2));
 				}
 
-				hit_stack.push(*s);
 				continue;
 			}
 			else if (c1) {
@@ -200,14 +687,14 @@ Object* BVH::findIntersection(Ray& ray, BVHNode* current_node, float* t_ret) {
 
 		//Get from stack
 		while (true) {
-			if (hit_stack.empty()){
-				return closest_obj;
+			if (hit_stack.size() == stack_base){
+				return found;
 			}
 			else {
 				StackItem s = hit_stack.top();
 				hit_stack.pop();
 
-				if (s.t < *t_ret) {
+				if (s.t < hit.t) {
 					current_node = s.ptr;
 					break;
 				}
@@ -217,25 +704,18 @@ Object* BVH::findIntersection(Ray& ray, BVHNode* current_node, float* t_ret) {
 }
 
 
-bool BVH::Traverse(Ray& ray, Object** hit_obj, Vector& hit_point) {
-	float tmin = FLT_MAX;  //contains the closest primitive intersection
-	bool hit = false; 
+bool BVH::Traverse(const Ray& ray, HitRecord& hit) {
+	hit.t = ray.tmax;  //contains the closest primitive intersection
 
-	*hit_obj = findIntersection(ray, nodes[0], &tmin);
-	
-	if (*hit_obj == nullptr) {
-		return false;
-	}
-
-	hit_point = ray.origin + ray.direction * tmin;
-	return true;
+	return findIntersection(ray, nodes[0], hit);
 }
 
-bool BVH::findIntersection(Ray& ray, BVHNode* current_node) {
-	float t, max_t = ray.direction.length();
-	Object* closest_obj = nullptr;
+bool BVH::findIntersection(const Ray& ray, BVHNode* current_node) {
+	float t;
+	AABB bbox1, bbox2;
+	size_t stack_base = hit_stack.size();
 
-	if (!current_node->getAABB().intercepts(ray, t)) {
+	if (!nodeBounds(current_node, ray.time, bbox1).intercepts(ray, t)) {
 		return false;
 	}
 
@@ -245,7 +725,10 @@ bool BVH::findIntersection(Ray& ray, BVHNode* current_node) {
 			int base_index = current_node->getIndex(), size = current_node->getNObjs();
 
 			for (int i = base_index; i < base_index + size; i++) {
-				if (objects[i]->intercepts(ray, t) && t < max_t) {
+				if (objects[i]->anyHit(ray, ray.tmax)) {
+					// Leave the stack as it was for the next traversal
+					while (hit_stack.size() > stack_base)
+						hit_stack.pop();
 					return true;
 				}
 			}
@@ -255,16 +738,13 @@ bool BVH::findIntersection(Ray& ray, BVHNode* current_node) {
 			BVHNode* child1 = nodes[current_node->getIndex()];
 			BVHNode* child2 = nodes[current_node->getIndex() + 1];
 
-			bool c1 = child1->getAABB().intercepts(ray, t1);// Test node�s children
-			bool c2 = child2->getAABB().intercepts(ray, t2);// Test node�s children
-
-			StackItem* s = nullptr;
+			// Test node�s children: those entered beyond the light are skipped
+			bool c1 = nodeBounds(child1, ray.time, bbox1).intercepts(ray, t1);
+			bool c2 = nodeBounds(child2, ray.time, bbox2).intercepts(ray, t2);
 
 			if (c1 && c2) {
 				current_node = child1;
-
-				s = new StackItem(child2, t2);
-				hit_stack.push(*s);
+				hit_stack.push(StackItem(child2, t2));
 
 				continue;
 			}
@@ -280,7 +760,7 @@ bool BVH::findIntersection(Ray& ray, BVHNode* current_node) {
 
 		//Get from stack
 		
-		if (hit_stack.empty()) {
+		if (hit_stack.size() == stack_base) {
 			return false;
 		}
 		else {
@@ -292,6 +772,128 @@ bool BVH::findIntersection(Ray& ray, BVHNode* current_node) {
 	}
 }
 
-bool BVH::Traverse(Ray& ray) {  //shadow ray with length
+bool BVH::Traverse(const Ray& ray) {  //shadow ray with length
 	return findIntersection(ray, nodes[0]);
 }		
+
+// Slab test of the rays in mask against a node box. Returns the rays that cross the box before reaching their light sample
+unsigned int BVH::intersectPacket(AABB& bbox, ShadowPacket& packet, unsigned int mask) {
+	unsigned int hits = 0;
+
+	// The origin is shared by all the rays, so the offsets to the slabs are computed once per node
+	float min_x = bbox.min.x - packet.origin.x, max_x = bbox.max.x - packet.origin.x;
+	float min_y = bbox.min.y - packet.origin.y, max_y = bbox.max.y - packet.origin.y;
+	float min_z = bbox.min.z - packet.origin.z, max_z = bbox.max.z - packet.origin.z;
+
+#ifdef USE_SSE
+	__m128 min_x4 = _mm_set1_ps(min_x), max_x4 = _mm_set1_ps(max_x);
+	__m128 min_y4 = _mm_set1_ps(min_y), max_y4 = _mm_set1_ps(max_y);
+	__m128 min_z4 = _mm_set1_ps(min_z), max_z4 = _mm_set1_ps(max_z);
+	__m128 zero = _mm_setzero_ps();
+
+	for (int i = 0; i < packet.size; i += 4) {  // 4 rays at a time
+		if (((mask >> i) & 0xF) == 0)
+			continue;
+
+		__m128 inv_x = _mm_load_ps(packet.inv_dx + i);
+		__m128 inv_y = _mm_load_ps(packet.inv_dy + i);
+		__m128 inv_z = _mm_load_ps(packet.inv_dz + i);
+
+		__m128 t0_x = _mm_mul_ps(min_x4, inv_x), t1_x = _mm_mul_ps(max_x4, inv_x);
+		__m128 t0_y = _mm_mul_ps(min_y4, inv_y), t1_y = _mm_mul_ps(max_y4, inv_y);
+		__m128 t0_z = _mm_mul_ps(min_z4, inv_z), t1_z = _mm_mul_ps(max_z4, inv_z);
+
+		//largest entering t value, from the origin on
+		__m128 t_near = _mm_max_ps(_mm_min_ps(t0_x, t1_x), _mm_min_ps(t0_y, t1_y));
+		t_near = _mm_max_ps(t_near, _mm_min_ps(t0_z, t1_z));
+		t_near = _mm_max_ps(t_near, zero);
+
+		//smallest exiting t value, up to the light sample
+		__m128 t_far = _mm_min_ps(_mm_max_ps(t0_x, t1_x), _mm_max_ps(t0_y, t1_y));
+		t_far = _mm_min_ps(t_far, _mm_max_ps(t0_z, t1_z));
+		t_far = _mm_min_ps(t_far, _mm_load_ps(packet.max_t + i));
+
+		hits |= (unsigned int)_mm_movemask_ps(_mm_cmple_ps(t_near, t_far)) << i;
+	}
+#else
+	for (int i = 0; i < packet.size; i++) {
+		if (!(mask & (1u << i)))
+			continue;
+
+		float t0_x = min_x * packet.inv_dx[i], t1_x = max_x * packet.inv_dx[i];
+		float t0_y = min_y * packet.inv_dy[i], t1_y = max_y * packet.inv_dy[i];
+		float t0_z = min_z * packet.inv_dz[i], t1_z = max_z * packet.inv_dz[i];
+
+		float t_near = MAX(MAX3(MIN(t0_x, t1_x), MIN(t0_y, t1_y), MIN(t0_z, t1_z)), 0.0f);
+		float t_far = MIN(MIN3(MAX(t0_x, t1_x), MAX(t0_y, t1_y), MAX(t0_z, t1_z)), packet.max_t[i]);
+
+		if (t_near <= t_far)
+			hits |= 1u << i;
+	}
+#endif
+
+	return hits & mask;
+}
+
+unsigned int BVH::Traverse(ShadowPacket& packet) {  //shadow rays with a common origin
+	unsigned int all_rays = packet.allRays(), occluded = 0;
+	AABB bbox;
+	Ray rays[PACKET_SIZE];	// for the objects of the leaves: built once, not per object tested
+
+	packet.pad();
+	for (int r = 0; r < packet.size; r++)
+		rays[r] = packet.getRay(r);
+
+	unsigned int mask = intersectPacket(nodeBounds(nodes[0], packet.time, bbox), packet, all_rays);
+	if (mask == 0)
+		return 0;
+
+	packet_stack.push(PacketItem(nodes[0], mask));
+
+	// A node is visited once for all the rays that hit it, and left as soon as they are all occluded
+	while (!packet_stack.empty()) {
+		PacketItem item = packet_stack.top();
+		packet_stack.pop();
+
+		BVHNode* current_node = item.ptr;
+		mask = item.mask & ~occluded;
+
+		if (mask == 0)
+			continue;
+
+		if (current_node->isLeaf()) {
+			int base_index = current_node->getIndex(), size = current_node->getNObjs();
+
+			for (int i = base_index; i < base_index + size && mask != 0; i++) {
+				for (int r = 0; r < packet.size; r++) {
+					if (!(mask & (1u << r)))
+						continue;
+
+					if (objects[i]->anyHit(rays[r], packet.max_t[r])) {
+						occluded |= 1u << r;
+						mask &= ~(1u << r);
+					}
+				}
+			}
+
+			if (occluded == all_rays) {
+				// Leave the stack empty for the next traversal
+				while (!packet_stack.empty())
+					packet_stack.pop();
+				return occluded;
+			}
+		}
+		else {
+			BVHNode* child1 = nodes[current_node->getIndex()];
+			BVHNode* child2 = nodes[current_node->getIndex() + 1];
+
+			unsigned int mask1 = intersectPacket(nodeBounds(child1, packet.time, bbox), packet, mask);
+			unsigned int mask2 = intersectPacket(nodeBounds(child2, packet.time, bbox), packet, mask);
+
+			if (mask2 != 0) packet_stack.push(PacketItem(child2, mask2));
+			if (mask1 != 0) packet_stack.push(PacketItem(child1, mask1));
+		}
+	}
+
+	return occluded;
+}
@@ -21,6 +21,7 @@ private:
 
 public:
 	Vector GetEye() { return eye; }
+	Vector GetAt() { return at; }
 	int GetResX()  { return res_x; }
     int GetResY()  { return res_y; }
 	float GetFov() { return fovy; }
@@ -70,6 +71,16 @@ public:
 		v = n % u;
 	}
 
+	void SetView(Vector from, Vector At, Vector Up) { // camera paths: a new viewpoint with the same field of view
+		at = At;
+		up = Up;
+		SetEye(from);
+
+		//Dimensions of the vis window
+		h = 2 * plane_dist * tan((PI * fovy / 180) / 2.0f);
+		w = ((float)res_x / res_y) * h;
+	}
+
 	Ray PrimaryRay(const Vector& pixel_sample) //  Rays cast from the Eye to a pixel sample which is in Viewport coordinates
 	{
 		float x, y, z;
@@ -78,7 +89,7 @@ public:
 		y = h * (pixel_sample.y / res_y - 0.5);
 		z = - plane_dist;
 
-		Vector ray_dir = (u * x + v * y + n * z).normalize();
+		Vector ray_dir = Combine(u, x, v, y, n, z).normalize();
 		return Ray(eye, ray_dir);  
 	}
 
@@ -94,10 +105,9 @@ public:
 		
 		Vector eye_offset = eye + u * lens_sample.x + v * lens_sample.y;
 		
-		Vector ray_dir = 
-			( u * (focal_plane_sample.x - lens_sample.x) + 
-			v * (focal_plane_sample.y - lens_sample.y) + 
-			n * focal_plane_sample.z).normalize();
+		Vector ray_dir = Combine(u, focal_plane_sample.x - lens_sample.x,
+			v, focal_plane_sample.y - lens_sample.y,
+			n, focal_plane_sample.z).normalize();
 
 		return Ray(eye_offset, ray_dir);
 	}
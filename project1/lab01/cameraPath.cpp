@@ -0,0 +1,109 @@
+#include <fstream>
+#include <string>
+#include <string.h>
+#include <algorithm>
+#include "cameraPath.h"
+#include "macros.h"
+
+void next_token(ifstream& file, char* token, const char* name);  // scene.cpp
+
+CameraPath::CameraPath(void) : num_frames(0) {}
+
+bool CameraPath::Load(const char* name)
+{
+	const int lineSize = 1024;
+	string cmd;
+	char token[256];
+	ifstream file(name, ios::in);
+
+	keys.clear();
+	num_frames = 0;
+
+	if (!file.is_open())
+	{
+		cerr << "Camera path file " << name << " not found.\n";
+		return false;
+	}
+
+	while (file >> cmd)
+	{
+		if (cmd == "frames")
+		{
+			file >> num_frames;
+		}
+		else if (cmd == "key")
+		{
+			Key key;
+
+			file >> key.frame;
+
+			next_token(file, token, "from");
+			file >> key.from;
+
+			next_token(file, token, "at");
+			file >> key.at;
+
+			next_token(file, token, "up");
+			file >> key.up;
+
+			keys.push_back(key);
+		}
+		else if (cmd[0] == '#')
+		{
+			file.ignore(lineSize, '\n');
+		}
+		else
+		{
+			cerr << "unknown command '" << cmd << "'.\n";
+			return false;
+		}
+	}
+
+	if (keys.empty() || num_frames <= 0)
+	{
+		cerr << "The camera path needs a number of frames and at least one key.\n";
+		return false;
+	}
+
+	std::stable_sort(keys.begin(), keys.end(), [](const Key& a, const Key& b) { return a.frame < b.frame; });
+	return true;
+}
+
+// Catmull-Rom spline through p1 (at t = 0) and p2 (at t = 1), with p0 and p3 setting the tangents
+static Vector catmullRom(Vector p0, Vector p1, Vector p2, Vector p3, float t)
+{
+	float t2 = t * t, t3 = t2 * t;
+
+	return (p1 * 2 + (p2 - p0) * t + (p0 * 2 - p1 * 5 + p2 * 4 - p3) * t2 + (p1 * 3 - p0 - p2 * 3 + p3) * t3) * 0.5f;
+}
+
+void CameraPath::GetView(int frame, Vector& from, Vector& at, Vector& up)
+{
+	int last = keys.size() - 1;
+
+	// Before the first key or after the last one, the camera stays still
+	if (frame <= keys[0].frame || last == 0)
+	{
+		from = keys[0].from; at = keys[0].at; up = keys[0].up;
+		return;
+	}
+	if (frame >= keys[last].frame)
+	{
+		from = keys[last].from; at = keys[last].at; up = keys[last].up;
+		return;
+	}
+
+	int i = 0;
+	while (keys[i + 1].frame <= frame)
+		i++;
+
+	Key& k0 = keys[MAX(i - 1, 0)];
+	Key& k1 = keys[i];
+	Key& k2 = keys[i + 1];
+	Key& k3 = keys[MIN(i + 2, last)];
+	float t = (float)(frame - k1.frame) / (k2.frame - k1.frame);
+
+	from = catmullRom(k0.from, k1.from, k2.from, k3.from, t);
+	at = catmullRom(k0.at, k1.at, k2.at, k3.at, t);
+	up = catmullRom(k0.up, k1.up, k2.up, k3.up, t).normalize();
+}
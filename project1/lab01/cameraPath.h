@@ -0,0 +1,33 @@
+#ifndef CAMERA_PATH_H
+#define CAMERA_PATH_H
+
+#include <vector>
+#include "vector.h"
+
+using namespace std;
+
+// Camera animation: views (from, at, up) keyed at some frames and interpolated in between by Catmull-Rom splines,
+// so the camera moves smoothly through the keys. File format, one command per line:
+//   frames <number of frames>
+//   key <frame> from <x y z> at <x y z> up <x y z>
+//   # comment
+class CameraPath
+{
+public:
+	CameraPath(void);
+
+	bool Load(const char* name);
+	int getNumFrames() { return num_frames; }
+	void GetView(int frame, Vector& from, Vector& at, Vector& up);
+
+private:
+	struct Key {
+		int frame;
+		Vector from, at, up;
+	};
+
+	vector<Key> keys;	// sorted by frame
+	int num_frames;
+};
+
+#endif
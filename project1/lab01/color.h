@@ -14,53 +14,53 @@ private:
 	float R, G, B;
 
 public:
-	Color()
+	constexpr Color()
 		: R(0.0), G(0.0), B(0.0)
 	{
 	}
-	Color(float r, float g, float b)
+	constexpr Color(float r, float g, float b)
 		: R(r), G(g), B(b)
 	{
 	}
 
-	float r() const
+	constexpr float r() const
 	{
 		return R;
 	}
-	float r(float r)
+	constexpr float r(float r)
 	{
 		return (R = r);
 	}
-	float g() const
+	constexpr float g() const
 	{
 		return G;
 	}
-	float g(float g)
+	constexpr float g(float g)
 	{
 		return (G = g);
 	}
-	float b() const
+	constexpr float b() const
 	{
 		return B;
 	}
-	float b(float b)
+	constexpr float b(float b)
 	{
 		return (B = b);
 	}
 
-	Color clamp() const
+	constexpr Color clamp() const
 	{
 		return Color(CLAMP(0.0, R, 1.0),
 					 CLAMP(0.0, G, 1.0),
 					 CLAMP(0.0, B, 1.0));
 	}
 
-	Color operator*(float c)
+	constexpr Color operator*(float c) const
 	{
 		return Color(R * c, G * c, B * c);
 	}
 
-	Color operator*=(float c)
+	constexpr Color& operator*=(float c)
 	{
 		R *= c;
 		G *= c;
@@ -68,23 +68,23 @@ public:
 		return *this;
 	}
 
-	Color operator+(Color c)
+	constexpr Color operator+(const Color& c) const
 	{
 		return Color(R + c.R, G + c.G, B + c.B);
 	}
-	Color operator*(Color c)
+	constexpr Color operator*(const Color& c) const
 	{
 		return Color(R * c.R, G * c.G, B * c.B);
 	}
 
-	Color operator+=(Color c)
+	constexpr Color& operator+=(const Color& c)
 	{
 		R += c.R;
 		G += c.G;
 		B += c.B;
 		return *this;
 	}
-	Color operator*=(Color c)
+	constexpr Color& operator*=(const Color& c)
 	{
 		R *= c.R;
 		G *= c.G;
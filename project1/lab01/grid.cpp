@@ -41,7 +41,7 @@ void Grid::Build(vector<Object*>& objs) {
 
 	//build the Grid BB and //insert scene objects in the Grid objects list
 	for (Object* obj : objs) {
-		AABB o_bbox = obj->GetBoundingBox();
+		AABB o_bbox = obj->GetSweptBoundingBox(shutter);
 		grid_bbox.extend(o_bbox);
 		this->addObject(obj);
 	}
@@ -74,7 +74,7 @@ void Grid::Build(vector<Object*>& objs) {
 	// insert the objects into the cells
 	for (auto &obj : objects) {   //vector iterator
 
-		AABB obb = obj->GetBoundingBox();
+		AABB obb = obj->GetSweptBoundingBox(shutter);
 
 		// Compute indices of both cells that contain min and max coord of obj bbox
 		int ixmin = clamp((obb.min.x - bbox.min.x) * nx / (bbox.max.x - bbox.min.x), 0, nx - 1);
@@ -97,7 +97,7 @@ void Grid::Build(vector<Object*>& objs) {
 }
 
 //Setup function for Grid traversal according to Amanatides&Woo algorithm
-bool Grid::Init_Traverse(Ray& ray, int& ix, int& iy, int& iz, double& dtx, double& dty, double& dtz, 
+bool Grid::Init_Traverse(const Ray& ray, int& ix, int& iy, int& iz, double& dtx, double& dty, double& dtz, 
 		double& tx_next, double& ty_next, double& tz_next, int& ix_step, int& iy_step, int& iz_step, int& ix_stop, int& iy_stop, int& iz_stop) {
 
 		
@@ -117,39 +117,13 @@ bool Grid::Init_Traverse(Ray& ray, int& ix, int& iy, int& iz, double& dtx, doubl
 	float y1 = bbox.max.y;
 	float z1 = bbox.max.z;
 
-	
-	float tx_min, ty_min, tz_min;
-	float tx_max, ty_max, tz_max;
-
-	float a = 1.0 / dx;
-	if (a >= 0) {
-		tx_min = (x0 - ox) * a;
-		tx_max = (x1 - ox) * a;
-	}
-	else {
-		tx_min = (x1 - ox) * a;
-		tx_max = (x0 - ox) * a;
-	}
-
-	float b = 1.0 / dy;
-	if (b >= 0) {
-		ty_min = (y0 - oy) * b;
-		ty_max = (y1 - oy) * b;
-	}
-	else {
-		ty_min = (y1 - oy) * b;
-		ty_max = (y0 - oy) * b;
-	}
-
-	float c = 1.0 / dz;
-	if (c >= 0) {
-		tz_min = (z0 - oz) * c;
-		tz_max = (z1 - oz) * c;
-	}
-	else {
-		tz_min = (z1 - oz) * c;
-		tz_max = (z0 - oz) * c;
-	}
+	// The sign of the direction tells which side of each slab is entered first
+	float tx_min = ((ray.sign[0] ? x1 : x0) - ox) * ray.inv_dir.x;
+	float tx_max = ((ray.sign[0] ? x0 : x1) - ox) * ray.inv_dir.x;
+	float ty_min = ((ray.sign[1] ? y1 : y0) - oy) * ray.inv_dir.y;
+	float ty_max = ((ray.sign[1] ? y0 : y1) - oy) * ray.inv_dir.y;
+	float tz_min = ((ray.sign[2] ? z1 : z0) - oz) * ray.inv_dir.z;
+	float tz_max = ((ray.sign[2] ? z0 : z1) - oz) * ray.inv_dir.z;
 
 	if (tx_min > ty_min)
 		t0 = tx_min;
@@ -167,7 +141,7 @@ bool Grid::Init_Traverse(Ray& ray, int& ix, int& iy, int& iz, double& dtx, doubl
 	if (tz_max < t1)
 		t1 = tz_max;
 
-	if (t0 > t1 || t1 < 0)   //crossover: ray does not intersect the Grid bounding box OR leaving point is behind the ray origin
+	if (t0 > t1 || t1 < ray.tmin)   //crossover: ray does not intersect the Grid bounding box OR leaving point is behind the ray origin
 		return(false);
 
 
@@ -244,7 +218,7 @@ bool Grid::Init_Traverse(Ray& ray, int& ix, int& iy, int& iz, double& dtx, doubl
 }
 
 //-----------------------------------------------------------------------GRID TRAVERSAL
-bool Grid::Traverse(Ray& ray, Object **hitobject, Vector& hitpoint) {
+bool Grid::Traverse(const Ray& ray, HitRecord& hit) {
 	int ix, iy, iz;
 	double 	tx_next, ty_next, tz_next;
 	double dtx, dty, dtz; 
@@ -256,26 +230,19 @@ bool Grid::Traverse(Ray& ray, Object **hitobject, Vector& hitpoint) {
 	if (!Init_Traverse(ray, ix, iy, iz, dtx, dty, dtz, tx_next, ty_next, tz_next, ix_step, iy_step, iz_step, ix_stop, iy_stop, iz_stop))
 		return false;   //ray does not intersect the Grid bounding box
 
-	std::vector<Object*> objs;
-	float closestDistance;
-	Object* closestObj = NULL;
-	float distance;
+	bool found;
 	
 	while (true) {
-		objs = cells[ix + nx * iy + nx * ny * iz];
-
-		closestDistance = FLT_MAX;
-		if (objs.size() != 0) 
-			for (auto obj : objs) //intersect Ray with all objects and find the closest hit point(if any)
-				if (obj->intercepts(ray, distance) && distance < closestDistance) {
-					closestDistance = distance;
-					closestObj = obj;
-				}
+		std::vector<Object*>& objs = cells[ix + nx * iy + nx * ny * iz];
+
+		found = false;
+		hit.t = ray.tmax;
+		for (auto obj : objs) //intersect Ray with all objects and find the closest hit point(if any)
+			if (obj->closestHit(ray, hit.t, hit))
+				found = true;
 		
 		if (tx_next < ty_next && tx_next < tz_next) {
-			if (closestDistance < tx_next) {
-					*hitobject = closestObj;
-					hitpoint = ray.origin +ray.direction * closestDistance;
+			if (found && hit.t < tx_next) {
 					return true;
 			}
 			tx_next += dtx;
@@ -284,9 +251,7 @@ bool Grid::Traverse(Ray& ray, Object **hitobject, Vector& hitpoint) {
 		}
 
 		else if (ty_next < tz_next) {
-				if (closestDistance < ty_next) {
-					*hitobject = closestObj;
-					hitpoint = ray.origin + ray.direction * closestDistance;
+				if (found && hit.t < ty_next) {
 					return true;
 				}
 				ty_next += dty;
@@ -295,9 +260,7 @@ bool Grid::Traverse(Ray& ray, Object **hitobject, Vector& hitpoint) {
 		}
 
 		else {
-			if (closestDistance < tz_next) {
-				*hitobject = closestObj;
-				hitpoint = ray.origin + ray.direction * closestDistance;
+			if (found && hit.t < tz_next) {
 				return true;
 			}
 			tz_next += dtz;
@@ -309,10 +272,7 @@ bool Grid::Traverse(Ray& ray, Object **hitobject, Vector& hitpoint) {
 }
 
 //-----------------------------------------------------------------------GRID TRAVERSAL FOR SHADOW RAY
-bool Grid::Traverse(Ray& ray) {  
-
-	double length = ray.direction.length(); //distance between light and intersection point
-	ray.direction.normalize();
+bool Grid::Traverse(const Ray& ray) {  
 
 	int ix, iy, iz;
 	double 	tx_next, ty_next, tz_next;
@@ -326,18 +286,19 @@ bool Grid::Traverse(Ray& ray) {
 	if (!Init_Traverse(ray, ix, iy, iz, dtx, dty, dtz, tx_next, ty_next, tz_next, ix_step, iy_step, iz_step, ix_stop, iy_stop, iz_stop))
 		return true;
 
-	std::vector<Object*> objs;
-	float distance;
-
 	while (true) {
-		objs = cells[ix + nx * iy + nx * ny * iz];
-		if (objs.size() != 0) 
-			//intersect Ray with all objects of each cell
-			for (auto &obj : objs) {
-				if (obj->intercepts(ray, distance) && distance < length) 
-					return true;
-			}
-		
+		std::vector<Object*>& objs = cells[ix + nx * iy + nx * ny * iz];
+
+		//intersect Ray with all objects of each cell
+		for (auto &obj : objs) {
+			if (obj->anyHit(ray, ray.tmax)) //tmax: distance between light and intersection point
+				return true;
+		}
+
+		// The cells beyond the light are not visited
+		if (MIN3(tx_next, ty_next, tz_next) >= ray.tmax)
+			return false;
+
 		if (tx_next < ty_next && tx_next < tz_next) {
 			tx_next += dtx;
 			ix += ix_step;
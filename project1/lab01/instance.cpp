@@ -0,0 +1,101 @@
+#include <fstream>
+#include <string>
+#include "instance.h"
+#include "maths.h"
+#include "macros.h"
+
+void read_mesh(ifstream& file, vector<Object*>& triangles, Arena& arena);  // scene.cpp
+
+Mesh::Mesh(void) {}
+
+bool Mesh::Load(const char* name, Arena& arena)
+{
+	const int lineSize = 1024;
+	string cmd;
+	ifstream file(name, ios::in);
+
+	if (!file.is_open())
+	{
+		cerr << "Mesh file " << name << " not found.\n";
+		return false;
+	}
+
+	// Every other command of the file is skipped
+	while (file >> cmd)
+	{
+		if (cmd == "mesh")
+			read_mesh(file, triangles, arena);
+		else
+			file.ignore(lineSize, '\n');
+	}
+
+	bvh.Build(triangles);
+	printf("Mesh %s: %d triangles\n", name, getNumTriangles());
+	return true;
+}
+
+MeshInstance::MeshInstance(Mesh* mesh_, float scale_, Vector rotation, Vector translation_)
+	: mesh(mesh_), scale(scale_), translation(translation_)
+{
+	float cx = cos(rotation.x * PI / 180), sx = sin(rotation.x * PI / 180);
+	float cy = cos(rotation.y * PI / 180), sy = sin(rotation.y * PI / 180);
+	float cz = cos(rotation.z * PI / 180), sz = sin(rotation.z * PI / 180);
+
+	// Rz * Ry * Rx
+	rows[0] = Vector(cz * cy, cz * sy * sx - sz * cx, cz * sy * cx + sz * sx);
+	rows[1] = Vector(sz * cy, sz * sy * sx + cz * cx, sz * sy * cx - cz * sx);
+	rows[2] = Vector(-sy, cy * sx, cy * cx);
+
+	// World bounds of the corners of the mesh bounds
+	AABB& local = mesh->getBVH().getBounds();
+	bbox = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+
+	for (int i = 0; i < 8; i++) {
+		Vector corner((i & 1) ? local.max.x : local.min.x, (i & 2) ? local.max.y : local.min.y, (i & 4) ? local.max.z : local.min.z);
+		Vector world = toWorld(corner) * scale + translation;
+
+		bbox.extend(AABB(world, world));
+	}
+}
+
+Vector MeshInstance::toObject(Vector v) {
+	// The inverse of a rotation is its transpose
+	return Vector(rows[0].x * v.x + rows[1].x * v.y + rows[2].x * v.z,
+		rows[0].y * v.x + rows[1].y * v.y + rows[2].y * v.z,
+		rows[0].z * v.x + rows[1].z * v.y + rows[2].z * v.z);
+}
+
+Vector MeshInstance::toWorld(Vector v) {
+	return Vector(rows[0] * v, rows[1] * v, rows[2] * v);
+}
+
+// The rotation keeps the direction normalized, so distances in object space are the world ones divided by the scale
+Ray MeshInstance::toObject(const Ray& r, float tmax) {
+	Ray local(toObject(r.origin - translation) * (1.0f / scale), toObject(r.direction), tmax / scale);
+
+	local.time = r.time;
+	return local;
+}
+
+bool MeshInstance::intersect(const Ray& r, float tmax, HitRecord& hit) {
+	HitRecord local;	// hit is left as it is on a miss
+
+	if (!mesh->getBVH().Traverse(toObject(r, tmax), local))
+		return false;
+
+	hit.t = local.t * scale;
+	hit.normal = toWorld(local.normal);
+	hit.object = this;
+	hit.prim_id = local.prim_id;
+	return true;
+}
+
+bool MeshInstance::occluded(const Ray& r, float tmax) {
+	return mesh->getBVH().Traverse(toObject(r, tmax));
+}
+
+void MeshInstance::Translate(Vector offset) {
+	translation = translation + offset;
+	bbox.min = bbox.min + offset;
+	bbox.max = bbox.max + offset;
+}
@@ -0,0 +1,50 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include <vector>
+#include "rayAccelerator.h"
+
+using namespace std;
+
+// Geometry stored once, in object space, with its own BVH: every instance of the mesh shares both
+class Mesh
+{
+public:
+	Mesh(void);
+
+	bool Load(const char* name, Arena& arena);  // the "mesh" commands of a P3F file; the triangles are allocated in arena
+	int getNumTriangles() { return triangles.size(); }
+	BVH& getBVH() { return bvh; }
+
+private:
+	vector<Object*> triangles;
+	BVH bvh;
+};
+
+// Mesh placed in the scene by a uniform scale, a rotation and a translation. Rays are taken into the object space
+// of the mesh to traverse its BVH, so the scene BVH only holds the bounds of the instances
+class MeshInstance : public Object
+{
+public:
+	MeshInstance(Mesh* mesh_, float scale_, Vector rotation, Vector translation_);  // rotation: angles (in degrees) around x, then y, then z
+
+	AABB GetBoundingBox(void) { return bbox; }
+
+protected:
+	void Translate(Vector offset);
+	bool intersect(const Ray& r, float tmax, HitRecord& hit);	// the primitive id is the triangle of the mesh
+	bool occluded(const Ray& r, float tmax);
+
+private:
+	Vector toObject(Vector v);	// rotates a world direction into object space
+	Vector toWorld(Vector v);
+	Ray toObject(const Ray& r, float tmax);
+
+	Mesh* mesh;
+	float scale;
+	Vector rows[3];		// rotation matrix, object to world
+	Vector translation;
+	AABB bbox;			// in world space
+};
+
+#endif
@@ -0,0 +1,368 @@
+#include <algorithm>
+#include <iterator>
+#include <cmath>
+#include "rayAccelerator.h"
+#include "macros.h"
+
+using namespace std;
+
+#define SIDE_BOTH 0
+#define SIDE_LEFT 1
+#define SIDE_RIGHT 2
+
+KdTree::KdTree(void) {}
+
+int KdTree::getNumObjects() { return objects.size(); }
+
+void KdTree::Build(vector<Object*>& objs_) {
+	vector<Event> events;
+
+	objs = objs_;
+	objects.clear();
+	nodes.clear();
+	sides.assign(objs.size(), SIDE_BOTH);
+
+	bbox = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+	for (Object* obj : objs)
+		bbox.extend(obj->GetSweptBoundingBox(shutter));
+	bbox.min.x -= EPSILON; bbox.min.y -= EPSILON; bbox.min.z -= EPSILON;
+	bbox.max.x += EPSILON; bbox.max.y += EPSILON; bbox.max.z += EPSILON;
+
+	// The events are sorted once, here; the splits keep both sides sorted
+	for (int ref = 0; ref < (int)objs.size(); ref++)
+		addEvents(ref, objs[ref]->GetSweptBoundingBox(shutter), events);
+	sort(events.begin(), events.end());
+
+	max_depth = (int)(8 + 1.3f * log2(MAX(1, (int)objs.size())));
+	nodes.push_back(KdNode());
+	build_recursive(events, 0, bbox, 0);
+
+	int ropes[6] = { -1, -1, -1, -1, -1, -1 };
+	set_ropes(0, ropes);
+	objs.clear();
+}
+
+int KdTree::getNumLeaves() {
+	int leaves = 0;
+
+	for (KdNode& node : nodes)
+		leaves += node.axis == KD_LEAF;
+	return leaves;
+}
+
+// Bounds of the part of an object inside a voxel. Moving objects are bounded by their box over the shutter time
+AABB KdTree::clippedBounds(int ref, const AABB& voxel) {
+	if (shutter > 0) {
+		AABB bounds = objs[ref]->GetSweptBoundingBox(shutter);
+
+		bounds.clip(voxel);
+		return bounds;
+	}
+
+	return objs[ref]->GetClippedBoundingBox(voxel);
+}
+
+void KdTree::addEvents(int ref, const AABB& bounds, vector<Event>& events) {
+	for (int axis = 0; axis < 3; axis++) {
+		float min = bounds.min.getAxisValue(axis), max = bounds.max.getAxisValue(axis);
+
+		if (min == max)
+			events.push_back(Event(min, axis, PLANAR, ref));
+		else {
+			events.push_back(Event(min, axis, START, ref));
+			events.push_back(Event(max, axis, END, ref));
+		}
+	}
+}
+
+// SAH cost of splitting the voxel at pos, relative to the intersection test of an object. The objects lying in
+// the plane go to the cheaper side
+float KdTree::splitCost(const AABB& voxel, int axis, float pos, int n_left, int n_right, int n_planar, bool& planar_left) {
+	AABB left = voxel, right = voxel;
+
+	left.max.setAxisValue(axis, pos);
+	right.min.setAxisValue(axis, pos);
+
+	float area = voxel.area();
+	float p_left = left.area() / area, p_right = right.area() / area;
+
+	float cost_left = p_left * (n_left + n_planar) + p_right * n_right;
+	float cost_right = p_left * n_left + p_right * (n_right + n_planar);
+
+	if (n_left + n_planar == 0 || n_right == 0) cost_left *= 1 - KD_EMPTY_BONUS;
+	if (n_left == 0 || n_right + n_planar == 0) cost_right *= 1 - KD_EMPTY_BONUS;
+
+	planar_left = cost_left < cost_right;
+	return KD_TRAVERSAL_COST + (planar_left ? cost_left : cost_right);
+}
+
+// The events of the node are swept once for the best plane along each axis, then shared out between the children:
+// those of the objects on one side go there in order, those crossing the plane are clipped to each side and merged
+void KdTree::build_recursive(vector<Event>& events, int node, const AABB& voxel, int depth) {
+	int n = 0;
+
+	for (Event& e : events)
+		n += e.axis == 0 && e.type != END;
+
+	int n_left[3] = { 0, 0, 0 }, n_right[3] = { n, n, n };
+	float best_cost = FLT_MAX, best_pos = 0;
+	int best_axis = 0;
+	bool best_planar_left = false;
+
+	for (size_t i = 0; i < events.size(); ) {
+		float pos = events[i].pos;
+		int axis = events[i].axis;
+		int ends = 0, planars = 0, starts = 0;
+
+		while (i < events.size() && events[i].axis == axis && events[i].pos == pos && events[i].type == END) { ends++; i++; }
+		while (i < events.size() && events[i].axis == axis && events[i].pos == pos && events[i].type == PLANAR) { planars++; i++; }
+		while (i < events.size() && events[i].axis == axis && events[i].pos == pos && events[i].type == START) { starts++; i++; }
+
+		n_right[axis] -= planars + ends;
+
+		// Planes on the faces of the voxel would leave an empty child
+		if (pos > voxel.min.getAxisValue(axis) && pos < voxel.max.getAxisValue(axis)) {
+			bool planar_left;
+			float cost = splitCost(voxel, axis, pos, n_left[axis], n_right[axis], planars, planar_left);
+
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_pos = pos;
+				best_axis = axis;
+				best_planar_left = planar_left;
+			}
+		}
+
+		n_left[axis] += starts + planars;
+	}
+
+	if (depth >= max_depth || best_cost >= n) {
+		nodes[node].axis = KD_LEAF;
+		nodes[node].bbox = voxel;
+		nodes[node].index = objects.size();
+		nodes[node].n_objs = n;
+		for (Event& e : events)
+			if (e.axis == 0 && e.type != END)
+				objects.push_back(objs[e.ref]);
+		return;
+	}
+
+	// Objects ending before the plane, or starting after it, are on one side only
+	for (Event& e : events)
+		sides[e.ref] = SIDE_BOTH;
+	for (Event& e : events) {
+		if (e.axis != best_axis)
+			continue;
+		if (e.type == END && e.pos <= best_pos)
+			sides[e.ref] = SIDE_LEFT;
+		else if (e.type == START && e.pos >= best_pos)
+			sides[e.ref] = SIDE_RIGHT;
+		else if (e.type == PLANAR)
+			sides[e.ref] = (e.pos < best_pos || (e.pos == best_pos && best_planar_left)) ? SIDE_LEFT : SIDE_RIGHT;
+	}
+
+	AABB left_voxel = voxel, right_voxel = voxel;
+	left_voxel.max.setAxisValue(best_axis, best_pos);
+	right_voxel.min.setAxisValue(best_axis, best_pos);
+
+	vector<Event> left_only, right_only, left_cut, right_cut;
+	for (Event& e : events) {
+		if (sides[e.ref] == SIDE_LEFT)
+			left_only.push_back(e);
+		else if (sides[e.ref] == SIDE_RIGHT)
+			right_only.push_back(e);
+		else if (e.axis == 0 && e.type != END) {	// once per object
+			addEvents(e.ref, clippedBounds(e.ref, left_voxel), left_cut);
+			addEvents(e.ref, clippedBounds(e.ref, right_voxel), right_cut);
+		}
+	}
+	vector<Event>().swap(events);
+
+	sort(left_cut.begin(), left_cut.end());
+	sort(right_cut.begin(), right_cut.end());
+
+	vector<Event> left_events, right_events;
+	left_events.reserve(left_only.size() + left_cut.size());
+	right_events.reserve(right_only.size() + right_cut.size());
+	merge(left_only.begin(), left_only.end(), left_cut.begin(), left_cut.end(), back_inserter(left_events));
+	merge(right_only.begin(), right_only.end(), right_cut.begin(), right_cut.end(), back_inserter(right_events));
+	vector<Event>().swap(left_only); vector<Event>().swap(left_cut);
+	vector<Event>().swap(right_only); vector<Event>().swap(right_cut);
+
+	// nodes may be reallocated below: the node is referred to by its index
+	int left = nodes.size();
+	nodes[node].axis = best_axis;
+	nodes[node].split = best_pos;
+	nodes[node].index = left;
+	nodes.push_back(KdNode());
+	nodes.push_back(KdNode());
+
+	build_recursive(left_events, left, left_voxel, depth + 1);
+	build_recursive(right_events, left + 1, right_voxel, depth + 1);
+}
+
+// Each child gets the ropes of its parent, plus one to its sibling across the plane. A leaf pushes its ropes down
+// the subtrees they point to, as long as a single child of theirs holds its whole face
+void KdTree::set_ropes(int node, int ropes[6]) {
+	KdNode& n = nodes[node];
+
+	if (n.axis != KD_LEAF) {
+		int left_ropes[6], right_ropes[6];
+
+		for (int f = 0; f < 6; f++)
+			left_ropes[f] = right_ropes[f] = ropes[f];
+		left_ropes[2 * n.axis + 1] = n.index + 1;
+		right_ropes[2 * n.axis] = n.index;
+
+		set_ropes(n.index, left_ropes);
+		set_ropes(n.index + 1, right_ropes);
+		return;
+	}
+
+	for (int f = 0; f < 6; f++) {
+		int rope = ropes[f];
+
+		while (rope >= 0 && nodes[rope].axis != KD_LEAF) {
+			KdNode& r = nodes[rope];
+
+			if (r.axis == f / 2)
+				rope = f % 2 ? r.index : r.index + 1;	// the child next to the face
+			else if (r.split >= n.bbox.max.getAxisValue(r.axis))
+				rope = r.index;
+			else if (r.split <= n.bbox.min.getAxisValue(r.axis))
+				rope = r.index + 1;
+			else
+				break;
+		}
+
+		n.ropes[f] = rope;
+	}
+}
+
+// Leaf holding the point p, from a node holding it. On a plane, the side the ray goes to
+int KdTree::descend(int node, const Vector& p, const Ray& ray) {
+	while (nodes[node].axis != KD_LEAF) {
+		KdNode& n = nodes[node];
+		float p_axis = p.getAxisValue(n.axis);
+
+		node = n.index + (p_axis > n.split || (p_axis == n.split && ray.direction.getAxisValue(n.axis) > 0));
+	}
+
+	return node;
+}
+
+// Distance at which the ray leaves the leaf, and the face it leaves it through
+float KdTree::leafExit(KdNode& leaf, const Ray& ray, int& face) {
+	float t_exit = FLT_MAX;
+
+	for (int axis = 0; axis < 3; axis++) {
+		float d = ray.direction.getAxisValue(axis);
+
+		if (d == 0)
+			continue;
+
+		float bound = d > 0 ? leaf.bbox.max.getAxisValue(axis) : leaf.bbox.min.getAxisValue(axis);
+		float t = (bound - ray.origin.getAxisValue(axis)) * ray.inv_dir.getAxisValue(axis);
+
+		if (t < t_exit) {
+			t_exit = t;
+			face = 2 * axis + (d > 0);
+		}
+	}
+
+	return t_exit;
+}
+
+// The ray goes from leaf to leaf through the ropes, from the leaf holding the point where it enters the next one.
+// Objects can reach out of a leaf, so a hit only ends the walk once it is inside the leaf
+bool KdTree::Traverse(const Ray& ray, HitRecord& hit) {
+	float t_entry;
+	bool found = false;
+	int node = 0, face = 0;
+
+	hit.t = ray.tmax;
+	if (!bbox.intercepts(ray, t_entry))
+		return false;
+	if (bbox.isInside(ray.origin))
+		t_entry = 0;
+
+	while (node >= 0) {
+		node = descend(node, ray.origin + ray.direction * t_entry, ray);
+
+		KdNode& leaf = nodes[node];
+		for (unsigned int i = leaf.index; i < leaf.index + leaf.n_objs; i++) {
+			if (objects[i]->closestHit(ray, hit.t, hit))
+				found = true;
+		}
+
+		float t_exit = leafExit(leaf, ray, face);
+		if (hit.t <= t_exit)
+			return found;
+
+		t_entry = MAX(t_entry, t_exit);
+		node = leaf.ropes[face];
+	}
+
+	return found;
+}
+
+bool KdTree::Traverse(const Ray& ray) {
+	float t_entry;
+	int node = 0, face = 0;
+
+	if (!bbox.intercepts(ray, t_entry))
+		return false;
+	if (bbox.isInside(ray.origin))
+		t_entry = 0;
+
+	while (node >= 0) {
+		node = descend(node, ray.origin + ray.direction * t_entry, ray);
+
+		KdNode& leaf = nodes[node];
+		for (unsigned int i = leaf.index; i < leaf.index + leaf.n_objs; i++) {
+			if (objects[i]->anyHit(ray, ray.tmax))
+				return true;
+		}
+
+		float t_exit = leafExit(leaf, ray, face);
+		if (t_exit >= ray.tmax)
+			return false;
+
+		t_entry = MAX(t_entry, t_exit);
+		node = leaf.ropes[face];
+	}
+
+	return false;
+}
+
+// Sum over the nodes of the probability of a ray through the tree reaching the node (ratio of surface areas) times its
+// cost: KD_TRAVERSAL_COST for an interior node, one intersection test per object for a leaf. The nodes only keep their
+// planes, so their boxes are worked out from the root down
+float KdTree::Cost() {
+	if (nodes.empty() || bbox.area() <= 0)
+		return 0;
+
+	float cost = 0;
+	vector<pair<int, AABB> > stack(1, make_pair(0, bbox));
+
+	while (!stack.empty()) {
+		KdNode& node = nodes[stack.back().first];
+		AABB voxel = stack.back().second;
+		stack.pop_back();
+
+		if (node.axis == KD_LEAF) {
+			cost += voxel.area() / bbox.area() * node.n_objs;
+			continue;
+		}
+
+		cost += voxel.area() / bbox.area() * KD_TRAVERSAL_COST;
+
+		AABB left = voxel, right = voxel;
+		left.max.setAxisValue(node.axis, node.split);
+		right.min.setAxisValue(node.axis, node.split);
+		stack.push_back(make_pair(node.index, left));
+		stack.push_back(make_pair(node.index + 1, right));
+	}
+
+	return cost;
+}
@@ -0,0 +1,139 @@
+#include <algorithm>
+#include "rayAccelerator.h"
+#include "maths.h"
+#include "macros.h"
+
+using namespace std;
+
+LightBVH::LightBVH(void) {}
+
+int LightBVH::getNumLights() { return lights.size(); }
+
+// Region where the light samples are taken: a point light or a rectangle in the XZ plane
+AABB LightBVH::lightBounds(Light* light) {
+	if (light->spl == 0)
+		return AABB(light->position, light->position);
+
+	return AABB(light->position, light->position + Vector(light->width, 0, light->height));
+}
+
+void LightBVH::Build(vector<Light*>& lights_) {
+	lights = lights_;
+	nodes.clear();
+
+	if (lights.empty())
+		return;
+
+	nodes.push_back(LightNode());
+	build_recursive(0, lights.size(), 0);
+}
+
+void LightBVH::build_recursive(int left_index, int right_index, int node_index) {
+
+	AABB bbox = lightBounds(lights[left_index]);
+	float power = 0;
+
+	for (int i = left_index; i < right_index; i++) {
+		Color c = lights[i]->color;
+
+		bbox.extend(lightBounds(lights[i]));
+		power += (c.r() + c.g() + c.b()) / 3;
+	}
+
+	nodes[node_index].bbox = bbox;
+	nodes[node_index].power = power;
+
+	if (right_index - left_index == 1) {  // one light per leaf
+		nodes[node_index].leaf = true;
+		nodes[node_index].index = left_index;
+		return;
+	}
+
+	// Median split along the largest extent of the light centroids
+	Vector min = Vector(FLT_MAX, FLT_MAX, FLT_MAX), max = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	AABB centroid_box = AABB(min, max);
+
+	for (int i = left_index; i < right_index; i++) {
+		Vector c = lightBounds(lights[i]).centroid();
+		centroid_box.extend(AABB(c, c));
+	}
+
+	Vector range = centroid_box.max - centroid_box.min;
+
+	Comparator cmp = Comparator();
+	cmp.dimension = 0;
+	if (range.y > range.getAxisValue(cmp.dimension)) cmp.dimension = 1;
+	if (range.z > range.getAxisValue(cmp.dimension)) cmp.dimension = 2;
+
+	int split_index = (left_index + right_index) / 2;
+	std::nth_element(lights.begin() + left_index, lights.begin() + split_index, lights.begin() + right_index, cmp);
+
+	// Children are stored next to each other: the left one at index, the right one at index + 1
+	int left_child = nodes.size();
+	nodes.push_back(LightNode());
+	nodes.push_back(LightNode());
+
+	nodes[node_index].leaf = false;
+	nodes[node_index].index = left_child;
+
+	build_recursive(left_index, split_index, left_child);
+	build_recursive(split_index, right_index, left_child + 1);
+}
+
+// Upper bound of the contribution of the lights of a node to a shading point. Lights do not fall off
+// with distance in this renderer, so it is the power of the node times the largest cosine between
+// the normal and a direction towards its bounding box
+float LightBVH::importance(LightNode& node, Vector& point, Vector& normal) {
+	Vector to_center = node.bbox.centroid() - point;
+	float dist = to_center.length();
+	float radius = (node.bbox.max - node.bbox.min).length() / 2;
+
+	if (dist <= radius)  // the point may be inside the node
+		return node.power;
+
+	float cos_center = (to_center / dist) * normal;
+	float theta_center = acos(MAX(-1.0f, MIN(1.0f, cos_center)));
+	float theta_bound = asin(radius / dist);  // half-angle of the cone bounding the box
+	float theta = MAX(0.0f, theta_center - theta_bound);
+
+	if (theta >= PI / 2)  // every light of the node is below the tangent plane
+		return 0;
+
+	return node.power * cos(theta);
+}
+
+// Walks down from the root choosing each child with a probability proportional to its importance.
+// pdf returns the probability of picking the light
+Light* LightBVH::Sample(Vector& point, Vector& normal, float& pdf) {
+	pdf = 1;
+
+	if (nodes.empty())
+		return nullptr;
+
+	LightNode* node = &nodes[0];
+
+	while (!node->leaf) {
+		LightNode& left = nodes[node->index];
+		LightNode& right = nodes[node->index + 1];
+
+		float i_left = importance(left, point, normal);
+		float i_right = importance(right, point, normal);
+		float total = i_left + i_right;
+
+		if (total <= 0)
+			return nullptr;
+
+		float p_left = i_left / total;
+
+		if (rand_float() < p_left) {
+			node = &left;
+			pdf *= p_left;
+		}
+		else {
+			node = &right;
+			pdf *= 1 - p_left;
+		}
+	}
+
+	return lights[node->index];
+}
@@ -9,3 +9,11 @@
 ? ( ( a ) > ( c ) ? ( a ) : ( c ) ) \
 : ( ( b ) > ( c ) ? ( b ) : ( c ) ) )
 
+// SSE (and SSE2) instructions are available: x86-64, or x86 compiled for them
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define USE_SSE
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE2
+#endif
+
@@ -15,6 +15,9 @@
 #include <chrono>
 #include <conio.h>
 #include <limits>
+#include <thread>
+#include <mutex>
+#include <atomic>
 
 #include <GL/glew.h>
 #include <GL/freeglut.h>
@@ -22,6 +25,10 @@
 
 #include "scene.h"
 #include "rayAccelerator.h"
+#include "rayQueue.h"
+#include "mappedImage.h"
+#include "resolve.h"
+#include "cameraPath.h"
 #include "maths.h"
 #include "macros.h"
 
@@ -31,7 +38,43 @@ bool P3F_scene = true; // choose between P3F scene or a built-in random scene
 
 //bool jittering = true; // Enable jittering
 
-#define MAX_DEPTH 4 // number of bounces
+bool wavefrontEnabled = false; // Trace the rays of each tile in bulk, one generation at a time
+
+bool sortSecondaryRays = false; // Wavefront: sort each generation of secondary rays for coherence
+
+bool adaptiveShadows = false; // Whitted: probe area lights first, and trace all their shadow rays only in penumbrae
+
+bool streamOutput = false; // Write the pixels straight into a memory-mapped image file while rendering
+
+bool streamPFM = false; // Streamed file is a PFM with float colours (RT_Output.pfm) instead of a PPM (RT_Output.ppm)
+
+const char* hdrOutput = NULL; // Also save the radiance: "RT_Output.pfm", or "RT_Output.exr" (DevIL built with OpenEXR)
+
+ResolveSettings display; // Exposure, tone mapping and gamma of the saved image; 'e' changes the exposure after rendering
+
+#define THROUGHPUT_CUTOFF 0.004f // Whitted: paths weighing less than this in the pixel colour are not traced
+
+#define TILE_SIZE 64 // tile side (in pixels) of the wavefront renderer
+
+#define PREVIEW_SCALE 8 // Drawing mode: while the camera moves, one ray per PREVIEW_SCALE x PREVIEW_SCALE pixels
+
+int orbitFrames = 0; // Console: render this many preview frames orbiting the camera and report the frame times
+
+const char* cameraPath = NULL; // Console: render the frames of a camera path file (e.g. "P3D_Scenes/balls_low.path") instead of one image
+
+int renderThreads = 0; // Camera paths: threads rendering the tiles of consecutive frames (0: one per core)
+
+#define FRAME_FILE "RT_Frame_%04d.png" // Camera paths: name of the frame images
+
+#define REBUILD_COST_RATIO 1.5f // Moving objects: the refitted BVH is built again once its SAH cost grows past this ratio
+
+float optimizeTime = 0; // BVH: seconds spent after loading the scene rotating the nodes of the BVH to lower its SAH cost (scenes rendered many times)
+
+bool compareAccel = false; // Before rendering, build the grid, the BVH and the kd-tree and report their build and traversal times
+
+float spatialSplits = 0; // BVH: spatial splits (SBVH) for long thin triangles, adding up to this fraction of the objects as references (e.g. 0.3)
+
+bool compareSpatialSplits = false; // BVH with spatial splits: also build the object split BVH and report its SAH cost and overlap
 
 #define CAPTION "Whitted Ray-Tracer"
 #define VERTEX_COORD_ATTRIB 0
@@ -62,9 +105,20 @@ float* vertices;
 int size_vertices;
 int size_colors;
 
+// Rendered radiance, unclamped: the image is resolved from it into img_Data
+float* hdr_Data;
+
 // Array of Pixels to be stored in a file by using DevIL library
 uint8_t* img_Data;
 
+// Image file written while rendering, instead of img_Data (streamOutput)
+MappedImage stream_image;
+
+// Drawing mode: block size (in pixels) of the last frame drawn, halved at each frame while the camera is still;
+// 0 once the full quality frame is drawn, -1 before the first frame
+int preview_scale = -1;
+Vector preview_eye;
+
 GLfloat m[16]; // projection matrix initialized by ortho function
 
 GLuint VaoId;
@@ -77,8 +131,13 @@ Scene* scene = NULL;
 
 Grid* grid_ptr = NULL;
 BVH* bvh_ptr = NULL;
+KdTree* kd_ptr = NULL;
+LightBVH* light_bvh_ptr = NULL;  // only built when few lights are sampled per shading point
 accelerator Accel_Struct;
 
+atomic<unsigned long long> raysTraced(0);  // rays traced (closest hit and shadow) since the rendering started
+static thread_local unsigned long long thread_rays = 0;  // ... by this thread, added to raysTraced after each tile
+
 int RES_X, RES_Y;
 
 int WindowHandle = 0;
@@ -240,15 +299,51 @@ void drawPoints()
 	checkOpenGLError("ERROR: Could not draw scene.");
 }
 
-ILuint saveImgFile(const char* filename)
+ILuint saveImgFile(const char* filename, uint8_t* pixels)
+{
+	ILuint ImageId;
+
+	ilEnable(IL_FILE_OVERWRITE);
+	ilGenImages(1, &ImageId);
+	ilBindImage(ImageId);
+
+	ilTexImage(RES_X, RES_Y, 1, 3, IL_RGB, IL_UNSIGNED_BYTE, pixels /*Texture*/);
+	ilSaveImage(filename);
+
+	ilDisable(IL_FILE_OVERWRITE);
+	ilDeleteImages(1, &ImageId);
+	if (ilGetError() != IL_NO_ERROR)
+		return ilGetError();
+
+	return IL_NO_ERROR;
+}
+
+// Save the radiance as floats: PFM is written here, other formats by DevIL
+ILuint saveHDRFile(const char* filename)
 {
+	const char* ext = strrchr(filename, '.');
+
+	if (ext != NULL && (strcmp(ext, ".pfm") == 0 || strcmp(ext, ".PFM") == 0))
+	{
+		FILE* file = fopen(filename, "wb");
+		if (file == NULL)
+			return IL_COULD_NOT_OPEN_FILE;
+
+		// Little-endian floats (negative scale), rows from bottom to top, as in hdr_Data
+		fprintf(file, "PF\n%d %d\n-1.0\n", RES_X, RES_Y);
+		size_t written = fwrite(hdr_Data, sizeof(float), 3 * RES_X * RES_Y, file);
+		fclose(file);
+
+		return written == (size_t)(3 * RES_X * RES_Y) ? IL_NO_ERROR : IL_COULD_NOT_OPEN_FILE;
+	}
+
 	ILuint ImageId;
 
 	ilEnable(IL_FILE_OVERWRITE);
 	ilGenImages(1, &ImageId);
 	ilBindImage(ImageId);
 
-	ilTexImage(RES_X, RES_Y, 1, 3, IL_RGB, IL_UNSIGNED_BYTE, img_Data /*Texture*/);
+	ilTexImage(RES_X, RES_Y, 1, 3, IL_RGB, IL_FLOAT, hdr_Data);
 	ilSaveImage(filename);
 
 	ilDisable(IL_FILE_OVERWRITE);
@@ -259,6 +354,43 @@ ILuint saveImgFile(const char* filename)
 	return IL_NO_ERROR;
 }
 
+// Save the radiance as it is, if hdrOutput is set
+void saveHDRImage()
+{
+	if (hdrOutput == NULL)
+		return;
+
+	if (saveHDRFile(hdrOutput) != IL_NO_ERROR)
+		printf("Error saving %s\n", hdrOutput);
+	else
+		printf("HDR image file %s created\n", hdrOutput);
+}
+
+// Resolve the radiance with the display settings and save the image files. No ray is traced
+void saveImage()
+{
+	resolveImage(hdr_Data, img_Data, 3 * RES_X * RES_Y, display);
+
+	if (saveImgFile("RT_Output.png", img_Data) != IL_NO_ERROR)
+	{
+		printf("Error saving Image file\n");
+		exit(0);
+	}
+	printf("Image file created\n");
+
+	saveHDRImage();
+}
+
+// Resolve the radiance into the OpenGL colours
+void resolveColors()
+{
+	int num_values = 3 * RES_X * RES_Y;
+
+	resolveImage(hdr_Data, img_Data, num_values, display);
+	for (int i = 0; i < num_values; i++)
+		colors[i] = img_Data[i] / 255.0f;
+}
+
 /////////////////////////////////////////////////////////////////////// CALLBACKS
 
 void timer(int value)
@@ -307,6 +439,14 @@ void reshape(int w, int h)
 	ortho(0, (float)RES_X, 0, (float)RES_Y, -1.0, 1.0);
 }
 
+void renderFrame();
+
+// Drawing mode: the idle callback traces frames only while the preview is being refined, so it is registered again when the camera moves
+void cameraMoved()
+{
+	glutIdleFunc(renderFrame);
+}
+
 void processKeys(unsigned char key, int xx, int yy)
 {
 	switch (key)
@@ -323,12 +463,23 @@ void processKeys(unsigned char key, int xx, int yy)
 		r = Eye.length();
 		beta = asinf(camY / r) * 180.0f / 3.14f;
 		alpha = atanf(camX / camZ) * 180.0f / 3.14f;
+		cameraMoved();
 		break;
 
 	case 'c':
 		printf("Camera Spherical Coordinates (%f, %f, %f)\n", r, beta, alpha);
 		printf("Camera Cartesian Coordinates (%f, %f, %f)\n", camX, camY, camZ);
 		break;
+
+	case '+':
+	case '-':
+		// Only the resolve pass runs again: the radiance of the last frame is shown with the new exposure
+		display.exposure += key == '+' ? 0.5f : -0.5f;
+		printf("Exposure %+.1f stops\n", display.exposure);
+		resolveColors();
+		drawPoints();
+		glutSwapBuffers();
+		break;
 	}
 }
 
@@ -407,6 +558,7 @@ void processMouseMotion(int xx, int yy)
 	camX = rAux * sin(alphaAux * 3.14f / 180.0f) * cos(betaAux * 3.14f / 180.0f);
 	camZ = rAux * cos(alphaAux * 3.14f / 180.0f) * cos(betaAux * 3.14f / 180.0f);
 	camY = rAux * sin(betaAux * 3.14f / 180.0f);
+	cameraMoved();
 }
 
 void mouseWheel(int wheel, int direction, int x, int y)
@@ -419,6 +571,7 @@ void mouseWheel(int wheel, int direction, int x, int y)
 	camX = r * sin(alpha * 3.14f / 180.0f) * cos(beta * 3.14f / 180.0f);
 	camZ = r * cos(alpha * 3.14f / 180.0f) * cos(beta * 3.14f / 180.0f);
 	camY = r * sin(beta * 3.14f / 180.0f);
+	cameraMoved();
 }
 
 void setupGLEW()
@@ -486,30 +639,103 @@ Vector rand_in_unit_circle() {
 	return Vector(x, y, 0);
 }
 
-Color getDiffuseNSpecular(Ray shadow_ray, Material* material, Vector hit_ray_dir, Vector normal_vec, Vector light_dir, Color light_colour, float light_normal_dot_prod) {
-	Color colour;
-	bool in_shadow = false;
-	float hit_dist;
+// Closest intersection of the ray with the scene, using the selected acceleration structure
+bool getClosestHit(const Ray& ray, HitRecord& hit) {
+	bool found = false;
+
+	thread_rays++;
+
+	if (Accel_Struct == GRID_ACC) { // regular Grid
+		return grid_ptr->Traverse(ray, hit);
+	}
+	else if (Accel_Struct == BVH_ACC) { //BVH
+		return bvh_ptr->Traverse(ray, hit);
+	}
+	else if (Accel_Struct == KDTREE_ACC) {
+		return kd_ptr->Traverse(ray, hit);
+	}
+
+	//no acceleration
+	hit.t = ray.tmax;
+	for (int i = 0; i < scene->getNumObjects(); i++) {
+		if (scene->getObject(i)->closestHit(ray, hit.t, hit))
+			found = true;
+	}
+
+	return found;
+}
+
+// Any intersection between the shadow ray origin and the light (at tmax along the ray)
+bool isInShadow(Ray& shadow_ray) {
+	thread_rays++;
 
 	if (Accel_Struct == GRID_ACC) {
-		in_shadow = grid_ptr->Traverse(shadow_ray);
+		return grid_ptr->Traverse(shadow_ray);
 	}
 	else if (Accel_Struct == BVH_ACC) {
-		in_shadow = bvh_ptr->Traverse(shadow_ray);
+		return bvh_ptr->Traverse(shadow_ray);
+	}
+	else if (Accel_Struct == KDTREE_ACC) {
+		return kd_ptr->Traverse(shadow_ray);
 	}
-	else {
-		float max_dist = shadow_ray.direction.length();
 
-		for (int j = 0; j < scene->getNumObjects(); j++) {
-			if (scene->getObject(j)->intercepts(shadow_ray, hit_dist) && hit_dist < max_dist) {
-				in_shadow = true;
-				break;
-			}
+	for (int j = 0; j < scene->getNumObjects(); j++) {
+		if (scene->getObject(j)->anyHit(shadow_ray, shadow_ray.tmax)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Shadow rays of a packet, sharing their origin. Returns the mask of the occluded ones
+unsigned int isInShadow(ShadowPacket& packet) {
+	unsigned int occluded = 0;
+
+	if (Accel_Struct == BVH_ACC && packet.size > 1) {
+		thread_rays += packet.size;
+		return bvh_ptr->Traverse(packet);
+	}
+
+	for (int i = 0; i < packet.size; i++) {
+		Ray shadow_ray = packet.getRay(i);
+
+		if (isInShadow(shadow_ray))
+			occluded |= 1u << i;
+	}
+	return occluded;
+}
+
+// Trace the shadow rays of the light samples from origin, in packets, and mark the visible samples
+void traceShadowRays(Vector origin, float time, vector<LightSample>& samples) {
+	int next = 0, num_samples = samples.size();
+
+	while (next < num_samples) {
+		ShadowPacket packet(origin, time);
+		int index[PACKET_SIZE];
+
+		for (; next < num_samples && !packet.full(); next++) {
+			if (samples[next].visible)
+				continue;
+
+			index[packet.size] = next;
+			packet.add(samples[next].dir);
 		}
+
+		unsigned int occluded = isInShadow(packet);
+
+		for (int i = 0; i < packet.size; i++)
+			samples[index[i]].visible = !(occluded & (1u << i));
 	}
+}
 
-	if (in_shadow)
-		return colour;
+Color getEnvironmentColor(Ray& ray) {
+	if (scene->GetSkyBoxFlg())
+		return scene->GetSkyboxColor(ray);
+	return scene->GetBackgroundColor();
+}
+
+Color getDiffuseNSpecular(Material* material, Vector hit_ray_dir, Vector normal_vec, Vector light_dir, Color light_colour, float light_normal_dot_prod) {
+	Color colour;
 
 	Color diffuse_colour = material->GetDiffColor() * material->GetDiffuse() * light_normal_dot_prod;
 
@@ -531,59 +757,215 @@ Color getDiffuseNSpecular(Ray shadow_ray, Material* material, Vector hit_ray_dir
 	return colour;
 }
 
-Color rayTracing(Ray ray, int depth, float ior_i);
+// Shadow rays towards the corners and the centre of an area light. The probes that reach the light are appended
+// to samples, already known to be visible, each standing for the cell of the light grid it lies in.
+// Returns how many of them reach the light
+int probeAreaLight(Light* light, Vector hit_point, Vector normal_vec, float time, vector<LightSample>& samples) {
+	Vector refl_hit_point = hit_point + normal_vec * EPSILON;
+	Vector probes[5] = {
+		light->position,
+		light->position + Vector(light->width, 0, 0),
+		light->position + Vector(0, 0, light->height),
+		light->position + Vector(light->width, 0, light->height),
+		light->position + Vector(light->width, 0, light->height) * 0.5
+	};
+	LightSample probe_samples[5];
+	ShadowPacket packet(refl_hit_point, time);
+
+	for (int i = 0; i < 5; i++) {
+		Vector light_dir = probes[i] - hit_point;
+		float light_normal_dot_product = (light_dir / light_dir.length()) * normal_vec;
+
+		if (light_normal_dot_product <= 0)
+			continue;
+
+		LightSample& sample = probe_samples[packet.size];
+		sample.dir = light_dir;
+		sample.cos_theta = light_normal_dot_product;
+		sample.colour = light->color * light->getPointIntensity() * 0.6;
+		sample.visible = true;
+		packet.add(light_dir);
+	}
+
+	unsigned int occluded = isInShadow(packet);
+	int visible = 0;
+
+	for (int i = 0; i < packet.size; i++) {
+		if (!(occluded & (1u << i))) {
+			samples.push_back(probe_samples[i]);
+			visible++;
+		}
+	}
+
+	return visible;
+}
+
+// Probing pays off only when the light has more samples than probes, and each probe needs a cell of its own.
+// The grid must be n x n: otherwise the sample loops cover more cells than the probes are placed for
+bool isProbedLight(Light* light) {
+	int n = (int)sqrt(light->spl);
+	return adaptiveShadows && n >= 3 && n * n == light->spl;
+}
+
+// The cells of the light grid already sampled by probeAreaLight: the four corners and the centre
+bool isProbeCell(int w, int h, int n) {
+	return ((w == 0 || w == n - 1) && (h == 0 || h == n - 1)) || (w == n / 2 && h == n / 2);
+}
+
+// Points of the light that illuminate the hit point (the ones facing the surface), appended to samples
+void getLightSamples(Light* light, Vector hit_point, Vector normal_vec, float time, vector<LightSample>& samples) {
+	LightSample sample;
+	Vector light_dir;
+	float sqrt_spl = sqrt(light->spl);
+
+	if (scene->GetSamplesPerPixel() == 0) {
+
+		if (light->spl == 0) {
+
+			light_dir = light->position - hit_point;
+
+			float light_normal_dot_product = (light_dir / light_dir.length()) * normal_vec;
+
+			if (light_normal_dot_product <= 0)
+				return;
+
+			//WARNING: added a coefficient to light color to make it less bright
+			sample.dir = light_dir;
+			sample.cos_theta = light_normal_dot_product;
+			sample.colour = light->color * 0.6;
+			samples.push_back(sample);
+
+		} else {
+			bool probed = isProbedLight(light);
+
+			if (probed) {
+				int visible_probes = probeAreaLight(light, hit_point, normal_vec, time, samples);
+
+				if (visible_probes == 0) // umbra
+					return;
+
+				// Fully lit: the samples are shaded without tracing their shadow rays.
+				// In a penumbra the probes already are samples of their cells, only the other spl - 5 cells are traced
+				sample.visible = visible_probes == 5;
+			}
+
+			for (int w = 0; w < sqrt_spl; w++) {
+				for (int h = 0; h < light->spl / sqrt_spl; h++) {
+					if (probed && isProbeCell(w, h, (int)sqrt_spl))
+						continue;
+
+					float e = rand_float();
+
+					//WARNING: added random variation as in anti-aliasing jittering
+					Vector light_pos = Vector(light->position.x + (w + e) * (light->width / sqrt_spl), light->position.y, light->position.z + (h + e) * (light->height / sqrt_spl));
+					light_dir = light_pos - hit_point;
+
+					float light_normal_dot_product = (light_dir / light_dir.length()) * normal_vec;
+
+					if (light_normal_dot_product <= 0)
+						continue;
+
+					//WARNING: added a coefficient to light color to make it less bright
+					Color light_color = light->color * light->getPointIntensity();
+					sample.dir = light_dir;
+					sample.cos_theta = light_normal_dot_product;
+					sample.colour = light_color * 0.6;
+					samples.push_back(sample);
+				}
+			}
+		}
+	}
+	else {
+
+		//with jittering
+		Vector light_point = light->spl == 0 ? light->position : light->getRandomLightPoint();
+
+		light_dir = light_point - hit_point;
+
+		float light_normal_dot_product = (light_dir / light_dir.length()) * normal_vec;
+
+		if (light_normal_dot_product <= 0)
+			return;
+
+		//WARNING: added a coefficient to light color to make it less bright
+		sample.dir = light_dir;
+		sample.cos_theta = light_normal_dot_product;
+		sample.colour = light->color * 0.6;
+		samples.push_back(sample);
+	}
+}
+
+// Light samples of a hit point: from every light of the scene or, with the light BVH,
+// from a few lights picked according to their contribution and weighted by the inverse of their probability
+void getShadingLightSamples(Vector hit_point, Vector normal_vec, float time, vector<LightSample>& samples) {
+	samples.clear();
+
+	if (light_bvh_ptr == NULL) {
+		for (int l = 0; l < scene->getNumLights(); l++)
+			getLightSamples(scene->getLight(l), hit_point, normal_vec, time, samples);
+		return;
+	}
+
+	unsigned int n = scene->GetLightsPerPoint();
+
+	for (unsigned int k = 0; k < n; k++) {
+		float pdf;
+		Light* light = light_bvh_ptr->Sample(hit_point, normal_vec, pdf);
+
+		if (light == NULL) // no light above the surface: the sample brings nothing but still counts in n
+			continue;
+
+		size_t first = samples.size();
+		getLightSamples(light, hit_point, normal_vec, time, samples);
+
+		for (size_t i = first; i < samples.size(); i++)
+			samples[i].colour = samples[i].colour * (1.0f / (n * pdf));
+	}
+}
 
-Color getReflection(Vector normal_vec, float cos_theta_i, Vector rev_ray_dir, Vector hit_point,
-	Material* material, int depth, float ior_i) {
+void getReflection(Vector normal_vec, float cos_theta_i, Vector rev_ray_dir, Vector hit_point,
+	Material* material, float ior_i, vector<SecondaryRay>& rays) {
 
 	Vector refl_ray_dir = normal_vec * cos_theta_i * 2 - rev_ray_dir;
 	float roughness = material->GetRoughness();
 	int spp = scene->GetSamplesPerPixel();
-	Color colour;
+	Color weight = material->GetSpecColor() * material->GetReflection();
 
 	if (roughness > 0) { // Fuzzy reflections
-	
+
 		// Anti-aliasing already shoots multiple rays,
 		// so we only need to shoot more than one here
 		// if anti-aliasing is deactivated
 		int sqrt_num_samples = (spp == 0) ? 2 : 1;
 		Vector mod_refl_ray_dir;
 
+		weight = weight * (1.0 / pow(sqrt_num_samples, 2)); // Average the added colours
+
 		for (int p = 0; p < sqrt_num_samples; p++) {
 			for (int q = 0; q < sqrt_num_samples; q++) {
 				mod_refl_ray_dir = (refl_ray_dir + rand_in_unit_sphere() * roughness).normalize(); // our implementation of random
 				//mod_refl_ray_dir = (refl_ray_dir + rnd_unit_sphere() * roughness).normalize();
-				
+
 				if (mod_refl_ray_dir * normal_vec < 0) {
 					continue;
 				}
 
-				Ray refl_ray(hit_point, mod_refl_ray_dir);
-
-				Color refl_colour = rayTracing(refl_ray, depth + 1, ior_i);
-				colour += material->GetSpecColor() * refl_colour * material->GetReflection();
+				rays.push_back(SecondaryRay(Ray(hit_point, mod_refl_ray_dir), weight, ior_i));
 			}
 		}
-
-		return colour * (1.0 / pow(sqrt_num_samples, 2)); // Average the added colours
+		return;
 	}
 
-	Ray refl_ray(hit_point, refl_ray_dir);
-
-	Color refl_colour = rayTracing(refl_ray, depth + 1, ior_i);
-	refl_colour = material->GetSpecColor() * refl_colour * material->GetReflection();
-
-	return refl_colour;
+	rays.push_back(SecondaryRay(Ray(hit_point, refl_ray_dir), weight, ior_i));
 }
 
-Color getRefraction(Vector hit_point, Vector normal_vec, Vector tangent_vec, float sin_theta_t, 
-	float cos_theta_t, Material* material, int depth, float ior_t, float Kr) {
+void getRefraction(Vector hit_point, Vector normal_vec, Vector tangent_vec, float sin_theta_t,
+	float cos_theta_t, Material* material, float ior_t, float Kr, vector<SecondaryRay>& rays) {
 
 	Vector refr_hit_point = hit_point - normal_vec * EPSILON;
 	Vector refr_ray_dir = tangent_vec * sin_theta_t - normal_vec * cos_theta_t;
 	float roughness = material->GetRoughness();
 	int spp = scene->GetSamplesPerPixel();
-	Color colour;
 
 	// THIS DOES NOT WORK!!!
 	// if (roughness > 0) { // Fuzzy refractions
@@ -607,134 +989,23 @@ Color getRefraction(Vector hit_point, Vector normal_vec, Vector tangent_vec, flo
 	// }
 
 	Ray refr_ray(refr_hit_point, refr_ray_dir);
-	Color refr_colour = rayTracing(refr_ray, depth + 1, ior_t);
-	return refr_colour * (1 - Kr);
+	rays.push_back(SecondaryRay(refr_ray, Color(1, 1, 1) * (1 - Kr), ior_t));
 }
 
-Color rayTracing(Ray ray, int depth, float ior_i) // index of refraction of medium 1 where the ray is travelling
-{
-	Color colour = Color();
-	float hit_dist, shortest_hit_dist = std::numeric_limits<float>::max();
-	Object* shortest_hit_object = nullptr;
-	Vector hit_point;
-	bool skybox_flg = scene->GetSkyBoxFlg();
-	bool hit = false;
-
-	if (Accel_Struct == NONE) { //no acceleration; your code here}
-	
-		for (int i = 0; i < scene->getNumObjects(); i++) {
-			Object* object = scene->getObject(i); 
-			if (object->intercepts(ray, hit_dist) && hit_dist < shortest_hit_dist) {
-				hit = true;
-				shortest_hit_dist = hit_dist;
-				shortest_hit_object = object;
-			}
-		}
-
-		hit_point = ray.origin + ray.direction * shortest_hit_dist;
-	}
-	else if (Accel_Struct == GRID_ACC) { // regular Grid
-		hit = grid_ptr->Traverse(ray, &shortest_hit_object, hit_point);
-
-	}
-	else if (Accel_Struct == BVH_ACC) { //BVH
-		hit = bvh_ptr->Traverse(ray, &shortest_hit_object, hit_point);
-	}
-
-	if (!hit) {
-		if (skybox_flg)
-			colour = scene->GetSkyboxColor(ray);
-		else
-			colour = scene->GetBackgroundColor();
-		return colour;
-	}
-		
-	Material* material = shortest_hit_object->GetMaterial();
-
-	Vector rev_ray_dir = ray.direction * (-1);
-
-	// Negate normal vector's direction if the ray comes from inside the object
-	Vector normal_vec = shortest_hit_object->getShadingNormal(rev_ray_dir, hit_point);
-
-	// To account for acne spots
-	Vector refl_hit_point = hit_point + normal_vec * EPSILON;
-	
-	float sqrt_spl;
-
-	for (int i = 0; i < scene->getNumLights(); i++)
-	{
-		Light* light = scene->getLight(i);
-		Vector light_dir;
-		sqrt_spl = sqrt(light->spl);
-		
-		if (scene->GetSamplesPerPixel() == 0) {
-
-			if (light->spl == 0) {
+// Reflected and refracted rays spawned at a hit point, each with its weight in the colour of the incoming ray
+void getSecondaryRays(Vector hit_point, Vector refl_hit_point, Vector normal_vec, Vector rev_ray_dir,
+	Material* material, float ior_i, vector<SecondaryRay>& rays) {
 
-				light_dir = light->position - hit_point;
-
-				float light_normal_dot_product = (light_dir / light_dir.length()) * normal_vec;
-
-				if (light_normal_dot_product <= 0)
-					continue;
-
-				Ray shadow_ray(refl_hit_point, light_dir);
-
-				//WARNING: added a coefficient to light color to make it less bright
-				colour += getDiffuseNSpecular(shadow_ray, material, rev_ray_dir, normal_vec, light_dir.normalize(), light->color * 0.6, light_normal_dot_product);
-
-			} else {
-				for (int w = 0; w < sqrt_spl; w++) {
-					for (int h = 0; h < light->spl / sqrt_spl; h++) {
-
-						float e = rand_float();
-
-						//WARNING: added random variation as in anti-aliasing jittering
-						Vector light_pos = Vector(light->position.x + (w + e) * (light->width / sqrt_spl), light->position.y, light->position.z + (h + e) * (light->height / sqrt_spl));
-						light_dir = light_pos - hit_point;
-
-						float light_normal_dot_product = (light_dir / light_dir.length()) * normal_vec;
-
-						if (light_normal_dot_product <= 0)
-							continue;
-
-						Ray shadow_ray(refl_hit_point, light_dir);
-
-						//WARNING: added a coefficient to light color to make it less bright
-						Color light_color = light->color * light->getPointIntensity();
-						colour += getDiffuseNSpecular(shadow_ray, material, rev_ray_dir, normal_vec, light_dir.normalize(), light_color * 0.6, light_normal_dot_product);
-					}
-				}
-			}
-		}
-		else {
-			
-			//with jittering
-			Vector light_point = light->spl == 0 ? light->position : light->getRandomLightPoint();
-
-			light_dir = light_point - hit_point;
-
-			float light_normal_dot_product = (light_dir / light_dir.length()) * normal_vec;
-
-			if (light_normal_dot_product <= 0)
-				continue;
-
-			Ray shadow_ray(refl_hit_point, light_dir);
-
-			//WARNING: added a coefficient to light color to make it less bright
-			colour += getDiffuseNSpecular(shadow_ray, material, rev_ray_dir, normal_vec, light_dir.normalize(), light->color * 0.6, light_normal_dot_product);
-		}
-	}
-
-	if (depth >= MAX_DEPTH || (material->GetTransmittance() == 0 && material->GetReflection() == 0))
-		return colour;
+	rays.clear();
 
 	//--------------------------------------------Only Reflective-------------------------------
 
 	float cos_theta_i = normal_vec * rev_ray_dir; // Because both vectors are normalised
 
-	if (material->GetTransmittance() == 0)
-		return colour + getReflection(normal_vec, cos_theta_i, rev_ray_dir, refl_hit_point, material, depth, ior_i);
+	if (material->GetTransmittance() == 0) {
+		getReflection(normal_vec, cos_theta_i, rev_ray_dir, refl_hit_point, material, ior_i, rays);
+		return;
+	}
 
 	//-----------------------------Dielectric (reflection + refraction)--------------------------
 
@@ -748,8 +1019,10 @@ Color rayTracing(Ray ray, int depth, float ior_i) // index of refraction of medi
 	float sin_theta_t = sin_theta_i * ior_i / ior_t;
 
 	//Total Reflection
-	if (sin_theta_t > 1)
-		return colour + getReflection(normal_vec, cos_theta_i, rev_ray_dir, refl_hit_point, material, depth, ior_i);
+	if (sin_theta_t > 1) {
+		getReflection(normal_vec, cos_theta_i, rev_ray_dir, refl_hit_point, material, ior_i, rays);
+		return;
+	}
 
 	float cos_theta_t = sqrt(1 - pow(sin_theta_t, 2));
 
@@ -765,130 +1038,799 @@ Color rayTracing(Ray ray, int depth, float ior_i) // index of refraction of medi
 		Vector refl_ray_dir = normal_vec * cos_theta_i * 2 - rev_ray_dir;
 		Ray reflected_ray(refl_hit_point, refl_ray_dir);
 
-		Color reflected_colour = rayTracing(reflected_ray, depth + 1, ior_i);
-		colour += material->GetSpecColor() * reflected_colour * Kr;
+		rays.push_back(SecondaryRay(reflected_ray, material->GetSpecColor() * Kr, ior_i));
 	}
 
-	return colour + getRefraction(hit_point, normal_vec, tangent_vec, sin_theta_t, cos_theta_t, material, depth, ior_t, Kr);
+	getRefraction(hit_point, normal_vec, tangent_vec, sin_theta_t, cos_theta_t, material, ior_t, Kr, rays);
 }
 
-// Render function by primary ray casting from the eye towards the scene's objects
-void renderScene()
-{
-	int index_pos = 0;
-	int index_col = 0;
-	unsigned int counter = 0;
-	float sqrt_spp = sqrt(scene->GetSamplesPerPixel());
-	Camera* camera = scene->GetCamera();
-	Accel_Struct = scene->GetAccelStruct();
-
-	// viewport coordinates
-	Vector pixel_sample, lens_sample;
-	float aperture = camera->GetAperture();
+// Decides whether a path goes on with the given throughput (weight in the pixel colour). Whitted ray tracing
+// drops negligible paths; distribution ray tracing plays Russian roulette with a survival probability equal to
+// the throughput, and scales up the survivors so that the estimate stays unbiased
+bool continuePath(Color& weight) {
+	float max_weight = MAX3(weight.r(), weight.g(), weight.b());
 
-	set_rand_seed(time(NULL) * time(NULL));
+	if (scene->GetSamplesPerPixel() == 0)
+		return max_weight >= THROUGHPUT_CUTOFF;
 
-	if (drawModeEnabled)
-	{
-		glClear(GL_COLOR_BUFFER_BIT);
-		camera->SetEye(Vector(camX, camY, camZ)); // Camera motion
-	}
+	if (max_weight >= 1)
+		return true;
 
-	for (int y = 0; y < RES_Y; y++)
-	{
-		for (int x = 0; x < RES_X; x++)
-		{
-			Color color = Color();
+	if (rand_float() >= max_weight)
+		return false;
 
-			if (aperture <= 0) { // No depth of field
-				if (sqrt_spp == 0) { // No anti-aliasing => Only one pixel sample!
+	weight = weight * (1 / max_weight);
+	return true;
+}
 
-					pixel_sample.x = x + 0.5f;
-					pixel_sample.y = y + 0.5f;
+// Iterative evaluation of all the ray paths spawned by a primary ray. Instead of recursing, the reflected and refracted
+// rays wait on an explicit stack together with their throughput, i.e. their weight in the colour of the primary ray
+Color rayTracing(Ray ray, int depth, float ior_i) // index of refraction of medium 1 where the ray is travelling
+{
+	Color colour = Color();
+	static thread_local PathStack stack;
+	vector<LightSample> light_samples;
+	vector<SecondaryRay> secondary_rays;
 
-					Ray ray = camera->PrimaryRay(pixel_sample); // function from camera.h
-					color = rayTracing(ray, 1, 1.0);
-				}
-				else { // Anti-aliasing => Average each ray's colour
-					for (int p = 0; p < sqrt_spp; p++) {
-						for (int q = 0; q < sqrt_spp; q++) {
+	stack.reserve(scene->GetMaxDepth());
+	stack.push(PathEntry(ray, Color(1, 1, 1), depth, ior_i));
 
-							pixel_sample.x = x + get_rand(p, p + 1) / sqrt_spp;
-							pixel_sample.y = y + get_rand(q, q + 1) / sqrt_spp;
+	while (!stack.empty()) {
+		PathEntry entry = stack.pop();
+		HitRecord hit;
 
-							Ray ray = camera->PrimaryRay(pixel_sample);
-							color += rayTracing(ray, 1, 1.0);
-						}
-					}
+		if (!getClosestHit(entry.ray, hit)) {
+			colour += entry.weight * getEnvironmentColor(entry.ray);
+			continue;
+		}
 
-					color = color * (1 / pow(sqrt_spp, 2));
-				}
-			}
-			else { // Add depth of field
-				int sqrt_spp_dof;
-				if (sqrt_spp == 0) { // No anti-aliasing => Only one pixel sample!
-					sqrt_spp_dof = 2;
-					pixel_sample.x = x + 0.5f;
-					pixel_sample.y = y + 0.5f;
-				}
-				else {
-					sqrt_spp_dof = sqrt_spp;
-				}
+		Material* material = scene->GetMaterial(hit.object->GetMaterial());
 
-				// Average each ray's colour
-				for (int p = 0; p < sqrt_spp_dof; p++) {
-					for (int q = 0; q < sqrt_spp_dof; q++) {
-						lens_sample = rand_in_unit_circle() * aperture; //our implementation of random
-						//lens_sample = rnd_unit_disk() * aperture;
-						
-						if (sqrt_spp != 0) { // Anti-aliasing => Each pixel sample is different
-							pixel_sample.x = x + get_rand(p, p + 1) / sqrt_spp_dof;
-							pixel_sample.y = y + get_rand(p, p + 1) / sqrt_spp_dof;
-							
-						}
-
-						Ray ray = camera->PrimaryRay(lens_sample, pixel_sample);
-						Color a = rayTracing(ray, 1, 1.0);
-						color += a;
-						
-					}
-				}
+		Vector hit_point = hit.getPoint(entry.ray);
+		Vector rev_ray_dir = entry.ray.direction * (-1);
 
-				color = color * (1 / pow(sqrt_spp_dof, 2));
-			}
-			color = color.clamp();
-			
-			img_Data[counter++] = u8fromfloat((float)color.r());
-			img_Data[counter++] = u8fromfloat((float)color.g());
-			img_Data[counter++] = u8fromfloat((float)color.b());
+		// Negate normal vector's direction if the ray comes from inside the object
+		Vector normal_vec = hit.getShadingNormal(rev_ray_dir);
 
-			if (drawModeEnabled)
-			{
-				vertices[index_pos++] = (float)x;
-				vertices[index_pos++] = (float)y;
-				colors[index_col++] = (float)color.r();
+		// To account for acne spots
+		Vector refl_hit_point = hit_point + normal_vec * EPSILON;
 
-				colors[index_col++] = (float)color.g();
+		getShadingLightSamples(hit_point, normal_vec, entry.ray.time, light_samples);
+		traceShadowRays(refl_hit_point, entry.ray.time, light_samples);
 
-				colors[index_col++] = (float)color.b();
-			}
+		for (LightSample& sample : light_samples) {
+			if (sample.visible)
+				colour += entry.weight * getDiffuseNSpecular(material, rev_ray_dir, normal_vec, sample.dir.normalize(), sample.colour, sample.cos_theta);
+		}
+
+		if (entry.depth >= scene->GetMaxDepth() || (material->GetTransmittance() == 0 && material->GetReflection() == 0))
+			continue;
+
+		getSecondaryRays(hit_point, refl_hit_point, normal_vec, rev_ray_dir, material, entry.ior, secondary_rays);
+
+		// Pushed backwards so they are traced in the same order as the former recursive evaluation
+		for (int i = (int)secondary_rays.size() - 1; i >= 0; i--) {
+			Color weight = entry.weight * secondary_rays[i].weight;
+
+			if (!continuePath(weight))
+				continue;
+
+			secondary_rays[i].ray.time = entry.ray.time;
+			stack.push(PathEntry(secondary_rays[i].ray, weight, entry.depth + 1, secondary_rays[i].ior));
+		}
+	}
+
+	return colour;
+}
+
+// Primary rays of the pixel (x, y). Returns the weight of each ray in the pixel colour
+float getPrimaryRays(Camera* camera, int x, int y, vector<Ray>& rays)
+{
+	float sqrt_spp = sqrt(scene->GetSamplesPerPixel());
+	float aperture = camera->GetAperture();
+	float shutter = scene->HasMotion() ? scene->GetShutter() : 0;
+
+	// viewport coordinates
+	Vector pixel_sample, lens_sample;
+
+	rays.clear();
+
+	if (aperture <= 0 && shutter <= 0) { // No depth of field nor motion blur
+		if (sqrt_spp == 0) { // No anti-aliasing => Only one pixel sample!
+
+			pixel_sample.x = x + 0.5f;
+			pixel_sample.y = y + 0.5f;
+
+			rays.push_back(camera->PrimaryRay(pixel_sample)); // function from camera.h
+			return 1;
+		}
+
+		// Anti-aliasing => Average each ray's colour
+		for (int p = 0; p < sqrt_spp; p++) {
+			for (int q = 0; q < sqrt_spp; q++) {
+
+				pixel_sample.x = x + get_rand(p, p + 1) / sqrt_spp;
+				pixel_sample.y = y + get_rand(q, q + 1) / sqrt_spp;
+
+				rays.push_back(camera->PrimaryRay(pixel_sample));
+			}
+		}
+
+		return 1 / pow(sqrt_spp, 2);
+	}
+
+	// Add depth of field and/or motion blur: both take the same samples
+	int sqrt_spp_dof;
+	if (sqrt_spp == 0) { // No anti-aliasing => Only one pixel sample!
+		sqrt_spp_dof = 2;
+		pixel_sample.x = x + 0.5f;
+		pixel_sample.y = y + 0.5f;
+	}
+	else {
+		sqrt_spp_dof = sqrt_spp;
+	}
+
+	// Average each ray's colour
+	for (int p = 0; p < sqrt_spp_dof; p++) {
+		for (int q = 0; q < sqrt_spp_dof; q++) {
+			if (aperture > 0) {
+				lens_sample = rand_in_unit_circle() * aperture; //our implementation of random
+				//lens_sample = rnd_unit_disk() * aperture;
+			}
+
+			if (sqrt_spp != 0) { // Anti-aliasing => Each pixel sample is different
+				pixel_sample.x = x + get_rand(p, p + 1) / sqrt_spp_dof;
+				pixel_sample.y = y + get_rand(p, p + 1) / sqrt_spp_dof;
+			}
+
+			if (aperture > 0)
+				rays.push_back(camera->PrimaryRay(lens_sample, pixel_sample));
+			else
+				rays.push_back(camera->PrimaryRay(pixel_sample));
+
+			// One shutter time per stratum of the open shutter
+			if (shutter > 0)
+				rays.back().time = shutter * (p * sqrt_spp_dof + q + rand_float()) / (sqrt_spp_dof * sqrt_spp_dof);
 		}
 	}
-	if (drawModeEnabled)
-	{
-		drawPoints();
-		glutSwapBuffers();
-	}
+
+	return 1 / pow(sqrt_spp_dof, 2);
+}
+
+// Store the final colour of pixel (x, y) in a radiance buffer. It is clamped and quantized later, by the resolve pass
+void writePixel(float* radiance, int x, int y, Color color)
+{
+	int index = y * RES_X + x;
+
+	radiance[3 * index] = (float)color.r();
+	radiance[3 * index + 1] = (float)color.g();
+	radiance[3 * index + 2] = (float)color.b();
+}
+
+// Copy the pixels of the tile [x0, x1[ x [y0, y1[ of the image to the streamed file, resolved as the saved image
+void streamTile(int x0, int y0, int x1, int y1)
+{
+	for (int y = y0; y < y1; y++)
+		stream_image.SetPixels(x0, y, hdr_Data + 3 * (y * RES_X + x0), x1 - x0, display);
+}
+
+
+/////////////////////////////////////////////////////////////////////// WAVEFRONT
+
+// Intersection stage: closest hit of every ray in the queue
+void intersectQueue(RayQueue& queue, HitQueue& hits)
+{
+	HitRecord hit;
+
+	hits.resize(queue.size());
+
+	for (int i = 0; i < queue.size(); i++) {
+		Ray ray = queue.getRay(i);
+
+		if (getClosestHit(ray, hit))
+			hits.set(i, hit.object, hit.getPoint(ray), hit.normal);
+		else
+			hits.object[i] = nullptr;
+	}
+}
+
+// Shading stage: misses take the environment colour, hits emit one shadow ray per light sample
+// and the reflected/refracted rays of the next generation
+void shadeQueue(RayQueue& queue, HitQueue& hits, ShadowQueue& shadow_queue, RayQueue& next_queue, Color* tile_colors)
+{
+	vector<LightSample> light_samples;
+	vector<SecondaryRay> secondary_rays;
+
+	for (int i = 0; i < queue.size(); i++) {
+		Ray ray = queue.getRay(i);
+		Color weight = queue.getWeight(i);
+		int pixel = queue.pixel[i];
+		float pixel_weight = queue.pixel_weight[i];
+		Object* hit_obj = hits.object[i];
+
+		if (hit_obj == nullptr) {
+			tile_colors[pixel] += weight * getEnvironmentColor(ray) * pixel_weight;
+			continue;
+		}
+
+		Material* material = scene->GetMaterial(hit_obj->GetMaterial());
+		Vector hit_point = hits.getPoint(i);
+		Vector rev_ray_dir = ray.direction * (-1);
+
+		// Negate normal vector's direction if the ray comes from inside the object
+		Vector normal_vec = hits.getNormal(i);
+		if (rev_ray_dir * normal_vec <= 0)
+			normal_vec = normal_vec * (-1);
+
+		// To account for acne spots
+		Vector refl_hit_point = hit_point + normal_vec * EPSILON;
+
+		getShadingLightSamples(hit_point, normal_vec, ray.time, light_samples);
+
+		for (LightSample& sample : light_samples) {
+			Ray shadow_ray(refl_hit_point, sample.dir, sample.dir.length());
+			shadow_ray.time = ray.time;
+			Color colour = getDiffuseNSpecular(material, rev_ray_dir, normal_vec, sample.dir.normalize(), sample.colour, sample.cos_theta);
+
+			if (sample.visible)
+				tile_colors[pixel] += weight * colour * pixel_weight;
+			else
+				shadow_queue.push(shadow_ray, weight * colour * pixel_weight, pixel);
+		}
+
+		if (queue.depth[i] >= scene->GetMaxDepth() || (material->GetTransmittance() == 0 && material->GetReflection() == 0))
+			continue;
+
+		getSecondaryRays(hit_point, refl_hit_point, normal_vec, rev_ray_dir, material, queue.ior[i], secondary_rays);
+
+		for (SecondaryRay& secondary : secondary_rays) {
+			Color secondary_weight = weight * secondary.weight;
+
+			secondary.ray.time = ray.time;
+			if (continuePath(secondary_weight))
+				next_queue.push(secondary.ray, secondary_weight, pixel, pixel_weight, queue.depth[i] + 1, secondary.ior);
+		}
+	}
+}
+
+// Shadow stage: visible light samples add their radiance to the pixel.
+// Consecutive shadow rays from the same hit point are traced as a packet
+void traceShadowQueue(ShadowQueue& shadow_queue, Color* tile_colors)
+{
+	int next = 0, num_rays = shadow_queue.size();
+
+	while (next < num_rays) {
+		int first = next;
+		ShadowPacket packet(Vector(shadow_queue.ox[first], shadow_queue.oy[first], shadow_queue.oz[first]), shadow_queue.time[first]);
+
+		for (; next < num_rays && !packet.full(); next++) {
+			if (shadow_queue.ox[next] != shadow_queue.ox[first] || shadow_queue.oy[next] != shadow_queue.oy[first] || shadow_queue.oz[next] != shadow_queue.oz[first] ||
+				shadow_queue.time[next] != shadow_queue.time[first])
+				break;
+
+			packet.add(Vector(shadow_queue.dx[next], shadow_queue.dy[next], shadow_queue.dz[next]), shadow_queue.max_t[next]);
+		}
+
+		unsigned int occluded = isInShadow(packet);
+
+		for (int i = 0; i < packet.size; i++)
+			if (!(occluded & (1u << i)))
+				tile_colors[shadow_queue.pixel[first + i]] += shadow_queue.getColor(first + i);
+	}
+}
+
+// Render the tile [x0, x1[ x [y0, y1[ one ray generation at a time
+void renderTileWavefront(Camera* camera, float* radiance, int x0, int y0, int x1, int y1)
+{
+	static thread_local RayQueue queue, next_queue;
+	static thread_local HitQueue hits;
+	static thread_local ShadowQueue shadow_queue;
+	vector<Ray> primary_rays;
+	Color tile_colors[TILE_SIZE * TILE_SIZE];
+	int tile_width = x1 - x0;
+
+	queue.clear();
+
+	for (int y = y0; y < y1; y++) {
+		for (int x = x0; x < x1; x++) {
+			float weight = getPrimaryRays(camera, x, y, primary_rays);
+			int pixel = (y - y0) * tile_width + (x - x0);
+
+			for (Ray& ray : primary_rays)
+				queue.push(ray, Color(1, 1, 1), pixel, weight, 1, 1.0);
+		}
+	}
+
+	while (queue.size() > 0) {
+		next_queue.clear();
+		shadow_queue.clear();
+
+		intersectQueue(queue, hits);
+		shadeQueue(queue, hits, shadow_queue, next_queue, tile_colors);
+		traceShadowQueue(shadow_queue, tile_colors);
+
+		if (sortSecondaryRays)
+			next_queue.sort();
+
+		swap(queue, next_queue);
+	}
+
+	for (int y = y0; y < y1; y++)
+		for (int x = x0; x < x1; x++)
+			writePixel(radiance, x, y, tile_colors[(y - y0) * tile_width + (x - x0)]);
+}
+
+// Render the tile [x0, x1[ x [y0, y1[ into the radiance buffer: pixel by pixel, or with the wavefront renderer
+void renderTile(Camera* camera, float* radiance, int x0, int y0, int x1, int y1)
+{
+	vector<Ray> primary_rays;
+
+	if (wavefrontEnabled)
+		renderTileWavefront(camera, radiance, x0, y0, x1, y1);
 	else
 	{
-		printf("Terminou o desenho!\n");
-		if (saveImgFile("RT_Output.png") != IL_NO_ERROR)
+		for (int y = y0; y < y1; y++)
+		{
+			for (int x = x0; x < x1; x++)
+			{
+				Color color = Color();
+				float weight = getPrimaryRays(camera, x, y, primary_rays);
+
+				for (Ray& ray : primary_rays)
+					color += rayTracing(ray, 1, 1.0);
+
+				writePixel(radiance, x, y, color * weight);
+			}
+		}
+	}
+
+	raysTraced += thread_rays;
+	thread_rays = 0;
+}
+
+// Full quality image: every pixel with all its samples. Without the wavefront renderer, the tiles are rows
+void renderImage(Camera* camera)
+{
+	int tile_width = wavefrontEnabled ? TILE_SIZE : RES_X;
+	int tile_height = wavefrontEnabled ? TILE_SIZE : 1;
+
+	for (int y = 0; y < RES_Y; y += tile_height)
+	{
+		for (int x = 0; x < RES_X; x += tile_width)
+		{
+			int x1 = MIN(x + tile_width, RES_X), y1 = MIN(y + tile_height, RES_Y);
+
+			renderTile(camera, hdr_Data, x, y, x1, y1);
+
+			if (stream_image.IsOpen())
+				streamTile(x, y, x1, y1); // straight into the image file as well
+		}
+	}
+}
+
+// Preview image: a single ray through the centre of each scale x scale block of pixels, whose colour fills the block
+void renderPreview(Camera* camera, int scale)
+{
+	Vector pixel_sample;
+
+	for (int y = 0; y < RES_Y; y += scale)
+	{
+		for (int x = 0; x < RES_X; x += scale)
+		{
+			int x1 = MIN(x + scale, RES_X), y1 = MIN(y + scale, RES_Y);
+
+			pixel_sample.x = 0.5f * (x + x1);
+			pixel_sample.y = 0.5f * (y + y1);
+
+			Color color = rayTracing(camera->PrimaryRay(pixel_sample), 1, 1.0);
+
+			for (int py = y; py < y1; py++)
+				for (int px = x; px < x1; px++)
+					writePixel(hdr_Data, px, py, color);
+		}
+	}
+}
+
+// Drawing mode: a coarse preview as soon as the camera moves, refined at each following frame up to the full quality image.
+// Nothing is traced once it has been drawn: the idle callback is removed until the camera moves again
+void renderFrame()
+{
+	Camera* camera = scene->GetCamera();
+	Vector eye = Vector(camX, camY, camZ);
+	int scale;
+
+	if (preview_scale < 0 || eye.x != preview_eye.x || eye.y != preview_eye.y || eye.z != preview_eye.z)
+	{
+		camera->SetEye(eye); // Camera motion
+		preview_eye = eye;
+		scale = PREVIEW_SCALE;
+	}
+	else if (preview_scale == 0)
+	{
+		glutIdleFunc(NULL);
+		return;
+	}
+	else
+		scale = preview_scale / 2;
+
+	// One ray per pixel without depth of field already is the full quality image
+	if (scale == 1 && scene->GetSamplesPerPixel() == 0 && camera->GetAperture() <= 0)
+		scale = 0;
+
+	set_rand_seed(time(NULL) * time(NULL));
+
+	if (scale > 0)
+		renderPreview(camera, scale);
+	else
+		renderImage(camera);
+	preview_scale = scale;
+
+	if (preview_scale == 0)
+		glutIdleFunc(NULL);
+
+	resolveColors();
+	drawPoints();
+	glutSwapBuffers();
+}
+
+// Redraw the last frame, without tracing any ray
+void displayFrame()
+{
+	drawPoints();
+	glutSwapBuffers();
+}
+
+// Render function by primary ray casting from the eye towards the scene's objects
+void renderScene()
+{
+	Camera* camera = scene->GetCamera();
+	Accel_Struct = scene->GetAccelStruct();
+
+	set_rand_seed(time(NULL) * time(NULL));
+
+	if (streamOutput)
+	{
+		const char* filename = streamPFM ? "RT_Output.pfm" : "RT_Output.ppm";
+
+		if (stream_image.Create(filename, RES_X, RES_Y, streamPFM))
+			printf("Streaming the image to %s\n", filename);
+		else
+			printf("Error creating %s: rendering to memory\n", filename);
+	}
+
+	renderImage(camera);
+
+	printf("Terminou o desenho!\n");
+	if (stream_image.IsOpen())
+	{
+		stream_image.Close();
+		printf("Image file streamed\n");
+		saveHDRImage(); // the streamed file replaces the PNG, not the radiance file
+		return;
+	}
+	saveImage();
+}
+
+// Headless camera path: preview frames orbiting the scene, as while the camera is dragged in drawing mode, then the
+// refinement of the last one. The time of each frame includes the resolve pass, as in drawing mode
+void renderOrbit()
+{
+	Camera* camera = scene->GetCamera();
+	Vector at = camera->GetAt();
+	Vector offset = camera->GetEye() - at;
+	float radius = offset.length();
+	float elevation = asinf(offset.y / radius), azimuth = atan2f(offset.x, offset.z);
+	double total = 0, slowest = 0;
+
+	set_rand_seed(time(NULL) * time(NULL));
+
+	// A full turn, ending back at the camera of the scene
+	for (int f = 1; f <= orbitFrames; f++)
+	{
+		float a = azimuth + 2 * PI * f / orbitFrames;
+		camera->SetEye(at + Vector(radius * sinf(a) * cosf(elevation), radius * sinf(elevation), radius * cosf(a) * cosf(elevation)));
+
+		auto frameStart = std::chrono::high_resolution_clock::now();
+		renderPreview(camera, PREVIEW_SCALE);
+		resolveImage(hdr_Data, img_Data, 3 * RES_X * RES_Y, display);
+		auto frameEnd = std::chrono::high_resolution_clock::now();
+
+		double frameTime = std::chrono::duration<double, std::milli>(frameEnd - frameStart).count();
+		total += frameTime;
+		slowest = MAX(slowest, frameTime);
+	}
+
+	if (orbitFrames > 0)
+		printf("Orbit: %d preview frames (1/%d resolution): %.2f ms per frame (%.1f FPS), slowest %.2f ms\n",
+			orbitFrames, PREVIEW_SCALE, total / orbitFrames, 1000 * orbitFrames / total, slowest);
+
+	// Refinement once the camera stops
+	for (int scale = PREVIEW_SCALE / 2; ; scale /= 2)
+	{
+		if (scale == 1 && scene->GetSamplesPerPixel() == 0 && camera->GetAperture() <= 0)
+			scale = 0;
+
+		auto frameStart = std::chrono::high_resolution_clock::now();
+		if (scale > 0)
+			renderPreview(camera, scale);
+		else
+			renderImage(camera);
+		resolveImage(hdr_Data, img_Data, 3 * RES_X * RES_Y, display);
+		auto frameEnd = std::chrono::high_resolution_clock::now();
+
+		double frameTime = std::chrono::duration<double, std::milli>(frameEnd - frameStart).count();
+		if (scale > 0)
+			printf("Refinement 1/%d: %.2f ms\n", scale, frameTime);
+		else
+			printf("Full quality: %.2f ms\n", frameTime);
+
+		if (scale == 0)
+			break;
+	}
+
+	saveImage();
+}
+
+// Acceleration structure over the objects of the scene, where they are now
+void buildAccelerator()
+{
+	vector<Object*> objs;
+	int num_objects = scene->getNumObjects();
+	float shutter = scene->HasMotion() ? scene->GetShutter() : 0;  // motion blur: bounds while the shutter is open
+
+	for (int o = 0; o < num_objects; o++)
+	{
+		objs.push_back(scene->getObject(o));
+	}
+
+	if (Accel_Struct == GRID_ACC)
+	{
+		delete grid_ptr;
+		grid_ptr = new Grid();
+		grid_ptr->setShutter(shutter);
+		grid_ptr->Build(objs);
+	}
+	else if (Accel_Struct == BVH_ACC)
+	{
+		if (bvh_ptr == NULL)
+			bvh_ptr = new BVH();
+		bvh_ptr->setShutter(shutter);
+		// Moving objects: updateScene refits the tree with the boxes of whole objects, which would undo the clipped references
+		bvh_ptr->setSpatialSplits(scene->HasMotion() ? 0 : spatialSplits);
+		bvh_ptr->Build(objs);
+	}
+	else if (Accel_Struct == KDTREE_ACC)
+	{
+		delete kd_ptr;
+		kd_ptr = new KdTree();
+		kd_ptr->setShutter(shutter);
+		kd_ptr->Build(objs);
+	}
+}
+
+// Time (ms) of the closest hits of one primary ray per pixel through the acceleration structure, without shading them
+double timeTraversal()
+{
+	Camera* camera = scene->GetCamera();
+	HitRecord hit;
+
+	auto timeStart = std::chrono::high_resolution_clock::now();
+	for (int y = 0; y < RES_Y; y++)
+		for (int x = 0; x < RES_X; x++)
+			getClosestHit(camera->PrimaryRay(Vector(x + 0.5f, y + 0.5f, 0)), hit);
+	auto timeEnd = std::chrono::high_resolution_clock::now();
+
+	return std::chrono::duration<double, std::milli>(timeEnd - timeStart).count();
+}
+
+// Each acceleration structure in turn, with the time to build it and to trace one primary ray per pixel through it
+void compareAccelerators()
+{
+	const char* names[] = { "", "Grid", "BVH", "kd-tree" };
+	accelerator selected = Accel_Struct;
+
+	for (int a = GRID_ACC; a <= KDTREE_ACC; a++)
+	{
+		Accel_Struct = (accelerator)a;
+
+		auto timeStart = std::chrono::high_resolution_clock::now();
+		buildAccelerator();
+		auto timeEnd = std::chrono::high_resolution_clock::now();
+
+		printf("%s: built in %.2f (sec), primary rays traversed in %.1f ms\n", names[a],
+			std::chrono::duration<double>(timeEnd - timeStart).count(), timeTraversal());
+	}
+	printf("\n");
+
+	Accel_Struct = selected;
+}
+
+// Tree rotations for optimizeTime seconds at most, with the SAH cost and the primary ray traversal time before and after
+void optimizeBVH()
+{
+	float cost = bvh_ptr->getBuildCost();
+	double before = timeTraversal();
+
+	auto timeStart = std::chrono::high_resolution_clock::now();
+	int rotations = bvh_ptr->Optimize(optimizeTime);
+	auto timeEnd = std::chrono::high_resolution_clock::now();
+
+	double after = timeTraversal();
+
+	printf("BVH optimized in %.2f (sec): %d rotations, SAH cost %.1f -> %.1f, primary rays traversed in %.1f -> %.1f ms (%.2fx)\n",
+		std::chrono::duration<double>(timeEnd - timeStart).count(), rotations, cost, bvh_ptr->getBuildCost(), before, after, before / after);
+}
+
+// Nodes, leaves, references and SAH cost of the kd-tree. Kept out of its Build, which animated scenes run every frame
+void reportKdTree()
+{
+	printf("kd-tree: %d nodes, %d leaves, %d references to %d objects, SAH cost %.1f\n", kd_ptr->getNumNodes(), kd_ptr->getNumLeaves(),
+		kd_ptr->getNumObjects(), scene->getNumObjects(), kd_ptr->Cost());
+}
+
+// Node overlap and SAH cost of the BVH. With spatial splits, those of the plain object split BVH are given as well
+void reportBVH()
+{
+	int num_objects = scene->getNumObjects();
+
+	printf("BVH: %d nodes, %d references to %d objects, SAH cost %.1f, node overlap %.3f\n", bvh_ptr->getNumNodes(),
+		bvh_ptr->getNumObjects(), num_objects, bvh_ptr->getBuildCost(), bvh_ptr->Overlap());
+
+	if (spatialSplits > 0 && scene->HasMotion())
+		printf("Moving objects: BVH built without spatial splits\n");
+	else if (spatialSplits > 0 && compareSpatialSplits)
+	{
+		vector<Object*> objs;
+		BVH object_bvh;
+
+		for (int o = 0; o < num_objects; o++)
+			objs.push_back(scene->getObject(o));
+		object_bvh.Build(objs);
+
+		printf("Object splits only: %d nodes, SAH cost %.1f (%+.1f%%), node overlap %.3f (%+.1f%%)\n", object_bvh.getNumNodes(),
+			object_bvh.getBuildCost(), 100 * (bvh_ptr->getBuildCost() / object_bvh.getBuildCost() - 1),
+			object_bvh.Overlap(), 100 * (bvh_ptr->Overlap() / object_bvh.Overlap() - 1));
+	}
+}
+
+// Moving objects: place them at the time of the frame and update the acceleration structure. The BVH is only refitted,
+// unless that has made its SAH cost grow past REBUILD_COST_RATIO times its cost when built; the grid is built again
+void updateScene(int frame)
+{
+	auto timeStart = std::chrono::high_resolution_clock::now();
+	bool rebuilt = true;
+
+	scene->SetTime((float)frame);
+
+	if (Accel_Struct == BVH_ACC)
+	{
+		bvh_ptr->Refit();
+
+		float cost = bvh_ptr->Cost();
+		rebuilt = cost > REBUILD_COST_RATIO * bvh_ptr->getBuildCost();
+		if (rebuilt)
 		{
-			printf("Error saving Image file\n");
-			exit(0);
+			printf("Frame %d: BVH cost %.1f, %.2f times its cost when built\n", frame, cost, cost / bvh_ptr->getBuildCost());
+			buildAccelerator();
+		}
+	}
+	else
+		buildAccelerator();
+
+	auto timeEnd = std::chrono::high_resolution_clock::now();
+	printf("Frame %d: objects moved, acceleration structure %s in %.2f ms\n", frame, rebuilt ? "built" : "refitted",
+		std::chrono::duration<double, std::milli>(timeEnd - timeStart).count());
+}
+
+// A frame of a camera path, while its tiles are being rendered
+struct AnimationFrame
+{
+	Camera camera;
+	vector<float> radiance;
+	atomic<int> tiles_left;
+
+	AnimationFrame(Camera& camera_, int num_tiles) : camera(camera_), radiance(3 * RES_X * RES_Y), tiles_left(num_tiles) {}
+};
+
+// Camera path: all the frames from the loaded scene and acceleration structure, so that each one only costs its tracing.
+// The threads take the tiles of the frames in order, so the last tiles of a frame and the first ones of the next frames
+// are rendered at the same time; the thread finishing the last tile of a frame resolves and saves it
+void renderAnimation()
+{
+	CameraPath path;
+
+	if (!path.Load(cameraPath))
+	{
+		printf("Error loading the camera path %s\n", cameraPath);
+		return;
+	}
+
+	int num_frames = path.getNumFrames();
+	int tiles_x = (RES_X + TILE_SIZE - 1) / TILE_SIZE, tiles_y = (RES_Y + TILE_SIZE - 1) / TILE_SIZE;
+	int tiles_per_frame = tiles_x * tiles_y, num_tiles = num_frames * tiles_per_frame;
+	int num_threads = renderThreads > 0 ? renderThreads : MAX(1, (int)thread::hardware_concurrency());
+
+	vector<AnimationFrame*> frames(num_frames, NULL);
+	int next_tile = 0, end_tile = num_tiles;
+	mutex tiles_lock, save_lock;  // DevIL has a single bound image, so frames are saved one at a time
+	unsigned int seed = time(NULL) * time(NULL);
+
+	printf("Rendering %d frames of %s with %d threads\n", num_frames, cameraPath, num_threads);
+
+	// Each thread of each batch of frames gets its own random sequence
+	auto worker = [&](int thread_index, int first_frame) {
+		vector<uint8_t> pixels(3 * RES_X * RES_Y);
+
+		set_rand_seed(seed + first_frame * num_threads + thread_index);
+
+		while (true) {
+			int tile, f;
+			{
+				lock_guard<mutex> lock(tiles_lock);
+				if (next_tile == end_tile)
+					return;
+
+				tile = next_tile++;
+				f = tile / tiles_per_frame;
+
+				if (tile % tiles_per_frame == 0) { // first tile of the frame
+					Vector from, at, up;
+					path.GetView(f, from, at, up);
+
+					frames[f] = new AnimationFrame(*scene->GetCamera(), tiles_per_frame);
+					frames[f]->camera.SetView(from, at, up);
+				}
+			}
+
+			AnimationFrame* frame = frames[f];
+			int x0 = (tile % tiles_per_frame) % tiles_x * TILE_SIZE, y0 = (tile % tiles_per_frame) / tiles_x * TILE_SIZE;
+
+			renderTile(&frame->camera, frame->radiance.data(), x0, y0, MIN(x0 + TILE_SIZE, RES_X), MIN(y0 + TILE_SIZE, RES_Y));
+
+			if (--frame->tiles_left > 0)
+				continue;
+
+			// Last tile of the frame
+			char filename[64];
+			sprintf(filename, FRAME_FILE, f);
+			resolveImage(frame->radiance.data(), pixels.data(), 3 * RES_X * RES_Y, display);
+			{
+				lock_guard<mutex> lock(save_lock);
+				if (saveImgFile(filename, pixels.data()) != IL_NO_ERROR)
+					printf("Error saving %s\n", filename);
+				else
+					printf("Frame %d saved: %s\n", f, filename);
+			}
+
+			delete frame;
 		}
-		printf("Image file created\n");
+	};
+
+	auto timeStart = std::chrono::high_resolution_clock::now();
+
+	// With moving objects every frame needs the scene at its own time, so the frames are rendered one after the other
+	// (with their tiles still in parallel)
+	int batch_frames = scene->HasMotion() ? 1 : num_frames;
+
+	for (int first_frame = 0; first_frame < num_frames; first_frame += batch_frames)
+	{
+		if (scene->HasMotion())
+			updateScene(first_frame);
+
+		next_tile = first_frame * tiles_per_frame;
+		end_tile = MIN(first_frame + batch_frames, num_frames) * tiles_per_frame;
+
+		vector<thread> threads;
+		for (int t = 1; t < num_threads; t++)
+			threads.push_back(thread(worker, t, first_frame));
+		worker(0, first_frame);
+		for (thread& t : threads)
+			t.join();
 	}
+
+	auto timeEnd = std::chrono::high_resolution_clock::now();
+	double passedTime = std::chrono::duration<double>(timeEnd - timeStart).count();
+	printf("%d frames: %.2f (sec), %.3f (sec) per frame\n", num_frames, passedTime, passedTime / num_frames);
 }
 
 ///////////////////////////////////////////////////////////////////////  SETUP     ///////////////////////////////////////////////////////
@@ -897,13 +1839,13 @@ void setupCallbacks()
 {
 	glutKeyboardFunc(processKeys);
 	glutCloseFunc(cleanup);
-	glutDisplayFunc(renderScene);
+	glutDisplayFunc(displayFrame);
 	glutReshapeFunc(reshape);
 	glutMouseFunc(processMouseButtons);
 	glutMotionFunc(processMouseMotion);
 	glutMouseWheelFunc(mouseWheel);
 
-	glutIdleFunc(renderScene);
+	glutIdleFunc(renderFrame);
 	glutTimerFunc(0, timer, 0);
 }
 void init(int argc, char* argv[])
@@ -931,6 +1873,7 @@ void init_scene(void)
 	char scenes_dir[70] = "P3D_Scenes/";
 	char input_user[50];
 	char scene_name[70];
+	auto loadStart = std::chrono::high_resolution_clock::now();
 
 	scene = new Scene();
 
@@ -953,6 +1896,7 @@ void init_scene(void)
 				break;
 		}
 
+		loadStart = std::chrono::high_resolution_clock::now();
 		scene->load_p3f(scene_name);
 		printf("Scene loaded.\n\n");
 	}
@@ -971,43 +1915,70 @@ void init_scene(void)
 	if (img_Data == NULL)
 		exit(1);
 
+	// Radiance buffer the image is rendered to
+	hdr_Data = (float*)malloc(3 * RES_X * RES_Y * sizeof(float));
+	if (hdr_Data == NULL)
+		exit(1);
+
 	Accel_Struct = scene->GetAccelStruct(); // Type of acceleration data structure
+	if (compareAccel)
+		compareAccelerators();
+	buildAccelerator();
 
-	if (Accel_Struct == GRID_ACC)
+	if (Accel_Struct == BVH_ACC)
 	{
-		grid_ptr = new Grid();
-		vector<Object*> objs;
-		int num_objects = scene->getNumObjects();
-
-		for (int o = 0; o < num_objects; o++)
-		{
-			objs.push_back(scene->getObject(o));
-		}
-		grid_ptr->Build(objs);
+		reportBVH();
+		if (optimizeTime > 0)
+			optimizeBVH();
+		printf("BVH built.\n\n");
+	}
+	else if (Accel_Struct == GRID_ACC)
 		printf("Grid built.\n\n");
+	else if (Accel_Struct == KDTREE_ACC)
+	{
+		reportKdTree();
+		printf("kd-tree built.\n\n");
 	}
-	else if (Accel_Struct == BVH_ACC)
+	else
+		printf("No acceleration data structure.\n\n");
+
+	// With many lights, only a few of them are sampled per shading point
+	delete light_bvh_ptr;  // of the previous scene
+	light_bvh_ptr = NULL;
+
+	unsigned int lights_per_point = scene->GetLightsPerPoint();
+	if (lights_per_point > 0 && scene->getNumLights() > (int)lights_per_point)
 	{
-		vector<Object*> objs;
-		int num_objects = scene->getNumObjects();
-		bvh_ptr = new BVH();
+		vector<Light*> lights;
+		int num_lights = scene->getNumLights();
+		light_bvh_ptr = new LightBVH();
 
-		for (int o = 0; o < num_objects; o++)
+		for (int l = 0; l < num_lights; l++)
 		{
-			objs.push_back(scene->getObject(o));
+			lights.push_back(scene->getLight(l));
 		}
 
-		bvh_ptr->Build(objs);
-		printf("BVH built.\n\n");
+		light_bvh_ptr->Build(lights);
+		printf("Light BVH built: %d of %d lights sampled per shading point.\n\n", lights_per_point, num_lights);
 	}
-	else
-		printf("No acceleration data structure.\n\n");
 
 	unsigned int spp = scene->GetSamplesPerPixel();
 	if (spp == 0)
-		printf("Whitted Ray-Tracing\n");
+		printf("Whitted Ray-Tracing (max depth = %d, throughput cutoff = %g)\n", scene->GetMaxDepth(), THROUGHPUT_CUTOFF);
 	else
-		printf("Distribution Ray-Tracing\n");
+		printf("Distribution Ray-Tracing (max depth = %d, Russian roulette)\n", scene->GetMaxDepth());
+
+	if (adaptiveShadows && spp == 0)
+		printf("Adaptive area light shadows\n");
+
+	if (wavefrontEnabled)
+		printf("Wavefront rendering%s\n", sortSecondaryRays ? " with sorted secondary rays" : "");
+
+	// The skybox faces were converted in the background while the acceleration structure was built
+	scene->WaitSkybox();
+
+	auto loadEnd = std::chrono::high_resolution_clock::now();
+	printf("Scene ready: %.2f (sec)\n", std::chrono::duration<double>(loadEnd - loadStart).count());
 }
 
 int main(int argc, char* argv[])
@@ -1026,15 +1997,39 @@ int main(int argc, char* argv[])
 			init_scene();
 
 			auto timeStart = std::chrono::high_resolution_clock::now();
-			renderScene(); // Just creating an image file
+			raysTraced = 0;
+			thread_rays = 0;
+			if (cameraPath != NULL)
+				renderAnimation(); // Numbered image files
+			else if (orbitFrames > 0)
+				renderOrbit(); // Frame times of an interactive session
+			else
+				renderScene(); // Just creating an image file
 			auto timeEnd = std::chrono::high_resolution_clock::now();
 			auto passedTime = std::chrono::duration<double, std::milli>(timeEnd - timeStart).count();
-			printf("\nDone: %.2f (sec)\n", passedTime / 1000);
+			raysTraced += thread_rays;  // e.g. those of the preview frames of an orbit
+			thread_rays = 0;
+			printf("\nDone: %.2f (sec), %.2f Mrays/sec\n", passedTime / 1000, raysTraced / (passedTime * 1000));
 			if (!P3F_scene)
 				break;
+
+			// Re-exposure: the image is resolved again from the radiance, no ray is traced
+			if (cameraPath == NULL)
+			{
+				cout << "\nPress 'e' to change the exposure (now " << display.exposure << " stops) or another key to continue\n";
+				while (toupper(ch = _getch()) == 'E')
+				{
+					cout << "Exposure (stops): ";
+					if (scanf("%f", &display.exposure) == 1)
+						saveImage();
+					cout << "\nPress 'e' to change the exposure (now " << display.exposure << " stops) or another key to continue\n";
+				}
+			}
+
 			cout << "\nPress 'y' to render another image or another key to terminate!\n";
 			delete (scene);
 			free(img_Data);
+			free(hdr_Data);
 			ch = _getch();
 		} while ((toupper(ch) == 'Y'));
 	}
@@ -1053,6 +2048,15 @@ int main(int argc, char* argv[])
 			exit(1);
 		memset(colors, 0, size_colors);
 
+		for (int y = 0; y < RES_Y; y++)
+		{
+			for (int x = 0; x < RES_X; x++)
+			{
+				vertices[2 * (y * RES_X + x)] = (float)x;
+				vertices[2 * (y * RES_X + x) + 1] = (float)y;
+			}
+		}
+
 		/* Setup GLUT and GLEW */
 		init(argc, argv);
 		glutMainLoop();
@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <string.h>
+#include "mappedImage.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+MappedImage::MappedImage(void) : width(0), height(0), pfm(false), data(NULL), size(0), pixels(NULL) {}
+
+MappedImage::~MappedImage() { Close(); }
+
+bool MappedImage::Create(const char* filename, int width_, int height_, bool pfm_) {
+	char header[64];
+	int header_size;
+
+	Close();
+
+	width = width_;
+	height = height_;
+	pfm = pfm_;
+
+	// PFM: little-endian floats (negative scale), rows from bottom to top. PPM: bytes, rows from top to bottom
+	if (pfm)
+		header_size = sprintf(header, "PF\n%d %d\n-1.0\n", width, height);
+	else
+		header_size = sprintf(header, "P6\n%d %d\n255\n", width, height);
+
+	size = header_size + (size_t)width * height * 3 * (pfm ? sizeof(float) : 1);
+
+#ifdef _WIN32
+	file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, (DWORD)((unsigned long long)size >> 32), (DWORD)(size & 0xFFFFFFFF), NULL);
+	if (mapping == NULL) {
+		CloseHandle(file);
+		return false;
+	}
+
+	data = (char*)MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size);
+	if (data == NULL) {
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+#else
+	fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return false;
+
+	// The file is extended with zeros: a black image
+	if (ftruncate(fd, size) != 0) {
+		close(fd);
+		return false;
+	}
+
+	void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		close(fd);
+		return false;
+	}
+	data = (char*)map;
+#endif
+
+	memcpy(data, header, header_size);
+	pixels = (unsigned char*)data + header_size;
+	return true;
+}
+
+void MappedImage::Close() {
+	if (data == NULL)
+		return;
+
+#ifdef _WIN32
+	FlushViewOfFile(data, 0);
+	UnmapViewOfFile(data);
+	CloseHandle(mapping);
+	CloseHandle(file);
+#else
+	msync(data, size, MS_SYNC);
+	munmap(data, size);
+	close(fd);
+#endif
+
+	data = NULL;
+	pixels = NULL;
+}
+
+void MappedImage::SetPixels(int x, int y, const float* radiance, int count, const ResolveSettings& settings) {
+	if (pfm)
+		// The header size is not a multiple of 4, so floats may be unaligned
+		memcpy(pixels + ((size_t)y * width + x) * 3 * sizeof(float), radiance, (size_t)count * 3 * sizeof(float));
+	else
+		resolveImage(radiance, pixels + ((size_t)(height - 1 - y) * width + x) * 3, 3 * count, settings);
+}
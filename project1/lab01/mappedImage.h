@@ -0,0 +1,39 @@
+#ifndef MAPPED_IMAGE_H
+#define MAPPED_IMAGE_H
+
+#include <stddef.h>
+#include "resolve.h"
+
+// Image file mapped in memory: pixels set on it reach the file without any staging copy,
+// so the file can be previewed by other programs while the image is being rendered.
+// PPM stores the colours resolved with the display settings, PFM stores the float colours as they are
+class MappedImage
+{
+public:
+	MappedImage(void);
+	~MappedImage();
+
+	bool Create(const char* filename, int width_, int height_, bool pfm_);  // the image starts black
+	void Close();  // flushes the pixels to the file
+	bool IsOpen() { return data != NULL; }
+
+	// count pixels of the row y from x, as RGB floats; y = 0 is the bottom row, as in the renderer
+	void SetPixels(int x, int y, const float* radiance, int count, const ResolveSettings& settings);
+
+private:
+	int width, height;
+	bool pfm;
+
+	char* data;				// whole file
+	size_t size;
+	unsigned char* pixels;	// after the header
+
+#ifdef _WIN32
+	void* file;				// HANDLEs
+	void* mapping;
+#else
+	int fd;
+#endif
+};
+
+#endif
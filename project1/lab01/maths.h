@@ -2,6 +2,7 @@
 #define __MATHS__
 
 #include <stdlib.h>
+#include <random>
 #include "vector.h"
 
 #define PI				3.141592653589793238462f
@@ -21,6 +22,7 @@ Vector rnd_unit_sphere(void);
 void set_rand_seed(const int seed);
 uint8_t u8fromfloat(float x);
 float u8tofloat(uint8_t x);
+unsigned int morton_code(unsigned int x, unsigned int y, unsigned int z);
 
 // inlined functions
 
@@ -53,20 +55,32 @@ clamp(const double x, const double min, const double max) {
 }
 
 
+// ---------------------------------------------------- rand_engine
+// Each thread draws from its own generator. rand() is per thread with the MSVC runtime,
+// but glibc shares it (behind a lock) between the threads rendering
+
+inline std::minstd_rand&
+rand_engine(void) {
+	static thread_local std::minstd_rand engine;
+	return engine;
+}
+
+
 // ---------------------------------------------------- rand_int
-// a wrapper for rand()
+// in [0, 2^31 - 3]
 
 inline int
 rand_int(void) {
-	return(rand());
+	return((int)(rand_engine()() - 1));
 }
 
 
 // ---------------------------------------------------- rand_float
+// in [0, 1[: the top 24 bits, all exact in a float
 
 inline float
 rand_float(void) {
-	return((float)rand() / ((float)RAND_MAX+1.0));
+	return((float)(rand_engine()() >> 7) * (1.0f / (1 << 24)));
 }
 
 
@@ -74,7 +88,7 @@ rand_float(void) {
 
 inline double
 rand_double(void) {
-	return((double)rand() / ((double)RAND_MAX + 1.0));
+	return((double)(rand_engine()() - 1) / 2147483646.0);
 }
 
 // ---------------------------------------------------- rand_double(min, max)
@@ -105,8 +119,8 @@ inline Vector rnd_unit_sphere(void) {
 
 // ---------------------------------------------------- set_rand_seed
 inline void
-set_rand_seed(const int seed) {
-	srand(seed);
+set_rand_seed(const int seed) {  // of the calling thread's generator
+	rand_engine().seed((unsigned int)seed);
 }
 
 // ---------------------------------------------------- float to byte (unsigned char)
@@ -122,4 +136,22 @@ inline  float u8tofloat(uint8_t x)
 	return (float)(x / 255.99f);
 }
 
+// ---------------------------------------------------- morton_code
+// interleaves the 10 lower bits of each coordinate (z-order curve index)
+
+inline unsigned int expand_bits(unsigned int v)
+{
+	v &= 0x3ff;
+	v = (v | (v << 16)) & 0x030000ff;
+	v = (v | (v << 8)) & 0x0300f00f;
+	v = (v | (v << 4)) & 0x030c30c3;
+	v = (v | (v << 2)) & 0x09249249;
+	return v;
+}
+
+inline unsigned int morton_code(unsigned int x, unsigned int y, unsigned int z)
+{
+	return (expand_bits(x) << 2) | (expand_bits(y) << 1) | expand_bits(z);
+}
+
 #endif
@@ -1,14 +1,31 @@
 #ifndef RAY_H
 #define RAY_H
 
+#include <cfloat>
 #include "vector.h"
 
+// The direction is normalized once, here, along with its reciprocal and signs for the slab tests of boxes.
+// Only hits at a distance in [tmin, tmax] along the ray count (a shadow ray ends at its light sample)
 class Ray
 {
 public:
-	Ray(const Vector& o, const Vector& dir ) : origin(o), direction(dir) {};
+	Ray() {};
+	Ray(const Vector& o, const Vector& dir, float tmax_ = FLT_MAX) : origin(o), direction(dir), tmax(tmax_) {
+		direction.normalize();
+		inv_dir = Vector(1.0 / direction.x, 1.0 / direction.y, 1.0 / direction.z);
+		sign[0] = inv_dir.x < 0; sign[1] = inv_dir.y < 0; sign[2] = inv_dir.z < 0;
+	};
+	// Direction already normalized, with its reciprocal worked out, as shadow packets store them
+	Ray(const Vector& o, const Vector& unit_dir, const Vector& inv_dir_, float tmax_) : origin(o), direction(unit_dir), inv_dir(inv_dir_), tmax(tmax_) {
+		sign[0] = inv_dir.x < 0; sign[1] = inv_dir.y < 0; sign[2] = inv_dir.z < 0;
+	};
 
 	Vector origin;
 	Vector direction;
+	Vector inv_dir;		// 1 / direction (infinite along the axes the direction is parallel to)
+	int sign[3];		// 1 if the direction is negative along the axis: the slab is entered by its max side
+	float tmin = 0;
+	float tmax = FLT_MAX;
+	float time = 0;	// motion blur: when the ray is traced, in frames after the shutter opens
 };
-#endif
\ No newline at end of file
+#endif
@@ -4,10 +4,62 @@
 #include <stack>
 #include <queue>
 #include <cmath>
+#include <chrono>
 #include "scene.h"
 
 using namespace std;
 
+/*********************************Shadow ray packets**************************************************/
+#define PACKET_SIZE 16	// multiple of 4 (SIMD width), at most 32 (bits of the occlusion mask)
+
+// Shadow rays leaving the same point towards several light samples, to be traced together.
+// Directions are stored normalized, with the distance to their light sample in max_t
+struct ShadowPacket
+{
+	Vector origin;
+	float time;		// motion blur: see Ray::time
+	int size;
+	alignas(16) float dx[PACKET_SIZE], dy[PACKET_SIZE], dz[PACKET_SIZE];
+	alignas(16) float inv_dx[PACKET_SIZE], inv_dy[PACKET_SIZE], inv_dz[PACKET_SIZE];
+	alignas(16) float max_t[PACKET_SIZE];
+
+	ShadowPacket(const Vector& origin_, float time_) : origin(origin_), time(time_), size(0) { }
+
+	bool full() { return size == PACKET_SIZE; }
+	unsigned int allRays() { return size == 32 ? ~0u : (1u << size) - 1; }
+	Ray getRay(int i) {
+		Ray ray(origin, Vector(dx[i], dy[i], dz[i]), Vector(inv_dx[i], inv_dy[i], inv_dz[i]), max_t[i]);
+		ray.time = time;
+		return ray;
+	}
+
+	// dir goes from the origin to the light sample
+	void add(Vector dir) {
+		float dist = dir.length();
+
+		add(Vector(dir.x / dist, dir.y / dist, dir.z / dist), dist);
+	}
+
+	// Normalized direction and distance to the light sample, e.g. those of a shadow ray
+	void add(const Vector& dir, float dist) {
+		dx[size] = dir.x; dy[size] = dir.y; dz[size] = dir.z;
+		inv_dx[size] = 1.0f / (fabs(dx[size]) > 1e-20f ? dx[size] : 1e-20f);
+		inv_dy[size] = 1.0f / (fabs(dy[size]) > 1e-20f ? dy[size] : 1e-20f);
+		inv_dz[size] = 1.0f / (fabs(dz[size]) > 1e-20f ? dz[size] : 1e-20f);
+		max_t[size] = dist;
+		size++;
+	}
+
+	// Fill the lanes after the last ray, so that SIMD tests only read initialized values
+	void pad() {
+		for (int i = size; i < PACKET_SIZE && i % 4 != 0; i++) {
+			dx[i] = dy[i] = dz[i] = 0;
+			inv_dx[i] = inv_dy[i] = inv_dz[i] = 1;
+			max_t[i] = -1;
+		}
+	}
+};
+
 class Grid
 {
 public:
@@ -17,9 +69,10 @@ public:
 	void addObject(Object* o);
 	void setAABB(AABB& bbox_);
 	Object* getObject(unsigned int index);
+	void setShutter(float shutter_) { shutter = shutter_; }  //motion blur: objects fill the cells they cross while the shutter is open
 	void Build(vector<Object*>& objs);   // set up grid cells
-	bool Traverse(Ray& ray, Object **hitobject, Vector& hitpoint);  //(const Ray& ray, double& tmin, ShadeRec& sr)
-	bool Traverse(Ray& ray);  //Traverse for shadow ray
+	bool Traverse(const Ray& ray, HitRecord& hit);  //closest hit
+	bool Traverse(const Ray& ray);  //Traverse for shadow ray
 
 private:
 	vector<Object *> objects;
@@ -27,15 +80,23 @@ private:
 
 	int nx, ny, nz; // number of cells in the x, y, and z directions
 	float m = 2.0f; // factor that allows to vary the number of cells
+	float shutter = 0;
 
 	//Setup function for Grid traversal
-	bool Init_Traverse(Ray& ray, int& ix, int& iy, int& iz, double& dtx, double& dty, double& dtz, double& tx_next, double& ty_next, double& tz_next, 
+	bool Init_Traverse(const Ray& ray, int& ix, int& iy, int& iz, double& dtx, double& dty, double& dtz, double& tx_next, double& ty_next, double& tz_next, 
 		int& ix_step, int& iy_step, int& iz_step, int& ix_stop, int& iy_stop, int& iz_stop);
 
 	AABB bbox;
 };
 
 /*********************************BVH*****************************************************************/
+#define SAH_TRAVERSAL_COST 1.0f		// SAH cost of visiting a node, relative to the intersection test of an object
+#define REFIT_PARALLEL_DEPTH 3		// a refit spreads the subtrees below this depth over threads (2^depth of them)
+#define REFIT_PARALLEL_MIN 4096		// ... if the BVH has at least this many objects
+#define OPTIMIZE_MIN_GAIN 0.001f	// tree rotations: passes stop once one lowers the SAH cost by less than this fraction
+#define SBVH_BINS 32				// spatial splits: candidate planes along each axis, between this many bins across the node
+#define SBVH_OVERLAP_ALPHA 1e-5f	// ... only tried where the children of the best object split overlap by more than this fraction of the root area
+
 class BVH
 {
 	class Comparator {
@@ -49,9 +110,17 @@ class BVH
 		}
 	};
 
+	// Object in a node, bounded by the part of it inside the node: spatial splits cut an object across several leaves
+	struct Reference {
+		Object* obj;
+		AABB bbox;
+		Reference(Object* _obj, const AABB& _bbox) : obj(_obj), bbox(_bbox) { }
+	};
+
 	class BVHNode {
 	private:
 		AABB bbox;
+		AABB close_bbox;	// motion blur: bounds when the shutter closes (bbox holds them when it opens)
 		bool leaf;
 		unsigned int n_objs;
 		unsigned int index;	// if leaf == false: index to left child node,
@@ -66,6 +135,8 @@ class BVH
 		unsigned int getIndex() { return index; }
 		unsigned int getNObjs() { return n_objs; }
 		AABB& getAABB() { return bbox; };
+		AABB& getCloseAABB() { return close_bbox; }
+		void setCloseAABB(AABB& bbox_) { close_bbox = bbox_; }
 	};
 
 private:
@@ -79,17 +150,155 @@ private:
 		StackItem(BVHNode* _ptr, float _t) : ptr(_ptr), t(_t) { }
 	};
 
-	stack<StackItem> hit_stack;
+	static thread_local stack<StackItem> hit_stack;	// per thread, so several threads can traverse the BVH
+
+	struct PacketItem {
+		BVHNode* ptr;
+		unsigned int mask;	// rays of the packet that hit the node
+		PacketItem(BVHNode* _ptr, unsigned int _mask) : ptr(_ptr), mask(_mask) { }
+	};
+
+	static thread_local stack<PacketItem> packet_stack;
+
+	unsigned int intersectPacket(AABB& bbox, ShadowPacket& packet, unsigned int mask);
+
+	float build_cost;	// SAH cost right after the last Build
+	float shutter = 0;	// motion blur: the node bounds are interpolated between shutter open and close
+	float spatial_budget = 0;	// spatial splits: references that may be added, as a fraction of the objects (0: object splits only)
+	int spatial_refs_left;		// ... while building
+	float root_area;
+
+	void build_spatial(vector<Reference>& refs, BVHNode* node);
+	float objectSplit(vector<Reference>& refs, int& best_axis, int& best_index);
+	float spatialSplit(vector<Reference>& refs, AABB& bbox, int& best_axis, float& best_plane);
+
+	void refit_recursive(BVHNode* node, int parallel_depth);
+	int rotate_recursive(BVHNode* node, int parallel_depth, chrono::steady_clock::time_point deadline);
+	int rotate(BVHNode* node);
+	AABB& nodeBounds(BVHNode* node, float time, AABB& moving_bbox);
 
 public:
 	BVH(void);
-	int getNumObjects();
+	~BVH();
+	int getNumObjects();	// references: an object cut by spatial splits counts once per leaf it is in
 	
+	void setShutter(float shutter_) { shutter = shutter_; }  //before Build: 0 for a still scene, or for no motion blur
+	void setSpatialSplits(float budget_) { spatial_budget = budget_; }  //before Build: SBVH for long thin objects, without motion blur nor refits
 	void Build(vector<Object*>& objects);
+	void Refit();	// node bounds recomputed bottom-up from the current bounds of the objects, keeping the tree
+	int Optimize(float seconds);	// after Build: tree rotations lowering the SAH cost, for that long at most. Returns how many were made
+	float Cost();	// surface area heuristic: expected cost of tracing a ray through the tree
+	float getBuildCost() { return build_cost; }
+	float Overlap();	// sum over the nodes of the area shared by their two children, relative to the root area
+	int getNumNodes() { return nodes.size(); }
 	void build_recursive(int left_index, int right_index, BVHNode* node);
-	bool Traverse(Ray& ray, Object** hit_obj, Vector& hit_point);
-	bool Traverse(Ray& ray);
-	Object* findIntersection(Ray& ray, BVHNode* currentNode, float* t_ret);
-	bool findIntersection(Ray& ray, BVHNode* currentNode);
+	bool Traverse(const Ray& ray, HitRecord& hit);  //closest hit before ray.tmax
+	bool Traverse(const Ray& ray);  //any hit before ray.tmax (shadow rays)
+	unsigned int Traverse(ShadowPacket& packet);  //shadow rays with a common origin: returns the mask of the occluded ones
+	AABB& getBounds() { return nodes[0]->getAABB(); }
+	bool findIntersection(const Ray& ray, BVHNode* currentNode, HitRecord& hit);  //closer than hit.t: updates hit
+	bool findIntersection(const Ray& ray, BVHNode* currentNode);
+};
+
+/*********************************kd-tree*************************************************************/
+#define KD_TRAVERSAL_COST 0.3f	// SAH cost of a traversal step, relative to the intersection test of an object
+#define KD_EMPTY_BONUS 0.2f		// fraction of the cost taken off the splits that leave one side empty
+#define KD_LEAF 3				// axis of a leaf node
+
+// SAH kd-tree (Wald and Havran): the split planes are taken from the sorted bounds of the objects, clipped to the
+// node, so each level takes a single sweep. Objects crossing a plane go to both sides. Each leaf has ropes to its
+// neighbours across its faces, so that rays walk from leaf to leaf without a stack
+class KdTree
+{
+	enum EventType { END, PLANAR, START };	// order of the events at the same position
+
+	// Where the bounds of an object (ref: index in objs) start, end or lie flat along an axis
+	struct Event {
+		float pos;
+		int axis;
+		EventType type;
+		int ref;
+		Event(float _pos, int _axis, EventType _type, int _ref) : pos(_pos), axis(_axis), type(_type), ref(_ref) { }
+		bool operator<(const Event& e) const {
+			return pos < e.pos || (pos == e.pos && (axis < e.axis || (axis == e.axis && type < e.type)));
+		}
+	};
+
+	struct KdNode {
+		AABB bbox;			// leaf: the part of space it covers, to find the face the ray leaves it through
+		float split;		// interior: position of the plane along axis
+		int axis;			// KD_LEAF for a leaf
+		unsigned int index;	// interior: index to left child node (the right one follows),
+							// leaf: index to first object in objects
+		unsigned int n_objs;
+		int ropes[6];		// leaf: deepest node holding the whole face across it (-x, +x, -y, +y, -z, +z), -1 outside the tree
+	};
+
+private:
+	vector<Object*> objs;		// objects of the scene, while building
+	vector<Object*> objects;	// objects of the leaves (those crossing a plane are in several leaves)
+	vector<KdNode> nodes;
+	vector<char> sides;			// while building: side of each object in the node being split
+	AABB bbox;
+	float shutter = 0;
+	int max_depth;
+
+	AABB clippedBounds(int ref, const AABB& voxel);
+	void addEvents(int ref, const AABB& bounds, vector<Event>& events);
+	float splitCost(const AABB& voxel, int axis, float pos, int n_left, int n_right, int n_planar, bool& planar_left);
+	void build_recursive(vector<Event>& events, int node, const AABB& voxel, int depth);
+	void set_ropes(int node, int ropes[6]);
+	int descend(int node, const Vector& p, const Ray& ray);
+	float leafExit(KdNode& leaf, const Ray& ray, int& face);
+
+public:
+	KdTree(void);
+	int getNumObjects();	// references: an object crossing planes counts once per leaf it is in
+	int getNumNodes() { return nodes.size(); }
+	int getNumLeaves();
+	void setShutter(float shutter_) { shutter = shutter_; }  //motion blur: objects are bounded while the shutter is open
+	void Build(vector<Object*>& objs);
+	bool Traverse(const Ray& ray, HitRecord& hit);  //closest hit before ray.tmax
+	bool Traverse(const Ray& ray);  //any hit before ray.tmax (shadow rays)
+	float Cost();	// surface area heuristic: expected cost of tracing a ray through the tree
+};
+
+/*********************************Light BVH***********************************************************/
+// Hierarchy over the lights of the scene, used to pick a few lights per shading point
+// with a probability proportional to an upper bound of their contribution
+class LightBVH
+{
+	class Comparator {
+	public:
+		int dimension;
+
+		bool operator() (Light* a, Light* b) {
+			return LightBVH::lightBounds(a).centroid().getAxisValue(dimension) < LightBVH::lightBounds(b).centroid().getAxisValue(dimension);
+		}
+	};
+
+	struct LightNode {
+		AABB bbox;			// bounds the area of all the lights below the node
+		float power;		// sum of the average colour of the lights below the node
+		bool leaf;
+		unsigned int index;	// if leaf == false: index to left child node,
+							// else if leaf == true: index to the Light in lights vector
+	};
+
+private:
+	vector<Light*> lights;
+	vector<LightNode> nodes;
+
+	void build_recursive(int left_index, int right_index, int node_index);
+	float importance(LightNode& node, Vector& point, Vector& normal);
+
+public:
+	LightBVH(void);
+	int getNumLights();
+
+	void Build(vector<Light*>& lights);
+	Light* Sample(Vector& point, Vector& normal, float& pdf);  //nullptr if no light can reach the point
+
+	static AABB lightBounds(Light* light);
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,204 @@
+#ifndef RAYQUEUE_H
+#define RAYQUEUE_H
+
+#include <vector>
+#include <algorithm>
+#include "scene.h"
+#include "maths.h"
+#include "macros.h"
+
+using namespace std;
+
+// Ray spawned at a hit point (reflection or refraction), with the weight of its contribution to the parent ray
+struct SecondaryRay {
+	Ray ray;
+	Color weight;
+	float ior;	// index of refraction of the medium where the ray travels
+
+	SecondaryRay(const Ray& r, const Color& w, float i) : ray(r), weight(w), ior(i) { }
+};
+
+/*********************************Path evaluation stack***********************************************/
+#define PATH_FAN_OUT 5	// most rays spawned at a hit: 2x2 fuzzy reflections and a refraction
+
+// Ray waiting to be traced by the iterative evaluator, with its weight in the pixel colour
+struct PathEntry {
+	Ray ray;
+	Color weight;	// throughput
+	int depth;
+	float ior;		// index of refraction of the medium where the ray travels
+
+	PathEntry() { }
+	PathEntry(const Ray& r, const Color& w, int d, float i) : ray(r), weight(w), depth(d), ior(i) { }
+};
+
+// Stack of the rays of a path. Depth first, it holds at most (PATH_FAN_OUT - 1) rays per level plus one, so it is
+// reserved for the depth of the scene once, and evaluating a path never allocates
+class PathStack
+{
+public:
+	void reserve(int max_depth) { entries.reserve((PATH_FAN_OUT - 1) * max_depth + 1); }
+	bool empty() { return entries.empty(); }
+	void push(const PathEntry& entry) { entries.push_back(entry); }
+	PathEntry pop() { PathEntry entry = entries.back(); entries.pop_back(); return entry; }
+
+private:
+	vector<PathEntry> entries;
+};
+
+/*********************************Wavefront queues****************************************************/
+// Queues store their rays as structures of arrays, so each stage of the wavefront
+// renderer walks contiguous buffers instead of chasing one ray through the whole scene.
+
+class RayQueue
+{
+public:
+	int size() { return (int)pixel.size(); }
+
+	void clear() {
+		ox.clear(); oy.clear(); oz.clear();
+		dx.clear(); dy.clear(); dz.clear();
+		wr.clear(); wg.clear(); wb.clear();
+		ior.clear(); time.clear(); depth.clear(); pixel.clear(); pixel_weight.clear();
+	}
+
+	void push(const Ray& ray, Color weight, int pixel_, float pixel_weight_, int depth_, float ior_) {
+		ox.push_back(ray.origin.x); oy.push_back(ray.origin.y); oz.push_back(ray.origin.z);
+		dx.push_back(ray.direction.x); dy.push_back(ray.direction.y); dz.push_back(ray.direction.z);
+		wr.push_back(weight.r()); wg.push_back(weight.g()); wb.push_back(weight.b());
+		ior.push_back(ior_);
+		time.push_back(ray.time);
+		depth.push_back(depth_);
+		pixel.push_back(pixel_);
+		pixel_weight.push_back(pixel_weight_);
+	}
+
+	Ray getRay(int i) {
+		Ray ray(Vector(ox[i], oy[i], oz[i]), Vector(dx[i], dy[i], dz[i]));
+		ray.time = time[i];
+		return ray;
+	}
+	Color getWeight(int i) { return Color(wr[i], wg[i], wb[i]); }
+
+	// Reorder the rays by direction octant, then by the Morton code of their origin,
+	// so that neighbouring rays in the queue head the same way from nearby points
+	void sort() {
+		int n = size();
+		if (n < 2)
+			return;
+
+		float min_x = FLT_MAX, min_y = FLT_MAX, min_z = FLT_MAX;
+		float max_x = -FLT_MAX, max_y = -FLT_MAX, max_z = -FLT_MAX;
+
+		for (int i = 0; i < n; i++) {
+			min_x = MIN(min_x, ox[i]); max_x = MAX(max_x, ox[i]);
+			min_y = MIN(min_y, oy[i]); max_y = MAX(max_y, oy[i]);
+			min_z = MIN(min_z, oz[i]); max_z = MAX(max_z, oz[i]);
+		}
+
+		// Origins are quantized to 10 bits per axis inside their bounding box
+		float scale_x = max_x > min_x ? 1023 / (max_x - min_x) : 0;
+		float scale_y = max_y > min_y ? 1023 / (max_y - min_y) : 0;
+		float scale_z = max_z > min_z ? 1023 / (max_z - min_z) : 0;
+
+		vector<pair<unsigned long long, int> > keys(n);
+
+		for (int i = 0; i < n; i++) {
+			unsigned long long octant = (dx[i] < 0) | ((dy[i] < 0) << 1) | ((dz[i] < 0) << 2);
+			unsigned int code = morton_code((unsigned int)((ox[i] - min_x) * scale_x),
+				(unsigned int)((oy[i] - min_y) * scale_y), (unsigned int)((oz[i] - min_z) * scale_z));
+
+			keys[i] = make_pair((octant << 30) | code, i);
+		}
+
+		std::sort(keys.begin(), keys.end());
+
+		permute(ox, keys); permute(oy, keys); permute(oz, keys);
+		permute(dx, keys); permute(dy, keys); permute(dz, keys);
+		permute(wr, keys); permute(wg, keys); permute(wb, keys);
+		permute(ior, keys); permute(time, keys); permute(depth, keys); permute(pixel, keys);
+		permute(pixel_weight, keys);
+	}
+
+	vector<float> ox, oy, oz;	// origins
+	vector<float> dx, dy, dz;	// directions
+	vector<float> wr, wg, wb;	// throughput of the path so far, what Russian roulette looks at
+	vector<float> ior;			// index of refraction of the medium where the ray travels
+	vector<float> time;			// motion blur: see Ray::time
+	vector<int> depth;
+	vector<int> pixel;			// index of the pixel (within the tile) the ray contributes to
+	vector<float> pixel_weight;	// share of the primary ray in its pixel (1 / samples), applied when accumulating
+
+private:
+	template <class T>
+	static void permute(vector<T>& v, vector<pair<unsigned long long, int> >& keys) {
+		vector<T> sorted(v.size());
+		for (size_t i = 0; i < keys.size(); i++)
+			sorted[i] = v[keys[i].second];
+		v.swap(sorted);
+	}
+};
+
+// Shadow rays and the radiance they bring to their pixel if the light sample is visible
+class ShadowQueue
+{
+public:
+	int size() { return (int)pixel.size(); }
+
+	void clear() {
+		ox.clear(); oy.clear(); oz.clear();
+		dx.clear(); dy.clear(); dz.clear();
+		max_t.clear();
+		cr.clear(); cg.clear(); cb.clear();
+		time.clear(); pixel.clear();
+	}
+
+	void push(const Ray& ray, Color colour, int pixel_) {
+		ox.push_back(ray.origin.x); oy.push_back(ray.origin.y); oz.push_back(ray.origin.z);
+		dx.push_back(ray.direction.x); dy.push_back(ray.direction.y); dz.push_back(ray.direction.z);
+		max_t.push_back(ray.tmax);
+		cr.push_back(colour.r()); cg.push_back(colour.g()); cb.push_back(colour.b());
+		time.push_back(ray.time);
+		pixel.push_back(pixel_);
+	}
+
+	Ray getRay(int i) {
+		Ray ray(Vector(ox[i], oy[i], oz[i]), Vector(dx[i], dy[i], dz[i]), max_t[i]);
+		ray.time = time[i];
+		return ray;
+	}
+	Color getColor(int i) { return Color(cr[i], cg[i], cb[i]); }
+
+	vector<float> ox, oy, oz;	// origins
+	vector<float> dx, dy, dz;	// towards the light sample
+	vector<float> max_t;		// distance to the light sample
+	vector<float> cr, cg, cb;	// radiance added to the pixel when the light sample is visible
+	vector<float> time;
+	vector<int> pixel;
+};
+
+// Output of the intersection stage: one entry per ray of a RayQueue
+class HitQueue
+{
+public:
+	void resize(int n) {
+		object.resize(n);
+		px.resize(n); py.resize(n); pz.resize(n);
+		nx.resize(n); ny.resize(n); nz.resize(n);
+	}
+
+	void set(int i, Object* obj, const Vector& point, const Vector& normal) {
+		object[i] = obj;
+		px[i] = point.x; py[i] = point.y; pz[i] = point.z;
+		nx[i] = normal.x; ny[i] = normal.y; nz[i] = normal.z;
+	}
+
+	Vector getPoint(int i) { return Vector(px[i], py[i], pz[i]); }
+	Vector getNormal(int i) { return Vector(nx[i], ny[i], nz[i]); }
+
+	vector<Object*> object;		// nullptr if the ray missed the scene
+	vector<float> px, py, pz;	// hit points
+	vector<float> nx, ny, nz;	// geometric normals
+};
+
+#endif
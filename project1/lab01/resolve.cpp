@@ -0,0 +1,87 @@
+#include <math.h>
+#include <vector>
+#include "resolve.h"
+#include "maths.h"
+#include "macros.h"
+
+#ifdef USE_SSE2
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+#define GAMMA_LUT_SIZE 65536 // entries of the gamma table, over [0, 1]
+
+// Scale, tone map and clamp one value to [0, 1]
+static inline float displayValue(float x, float scale, bool tone_mapping)
+{
+	x *= scale;
+	if (tone_mapping)
+		x = x / (1.0f + x);
+	return x > 0.0f ? (x < 1.0f ? x : 1.0f) : 0.0f; // NaN gives 0
+}
+
+void resolveImage(const float* radiance, uint8_t* pixels, int num_values, const ResolveSettings& settings)
+{
+	float scale = exp2f(settings.exposure);
+	bool tone_mapping = settings.tone_mapping;
+	bool linear = settings.gamma == 1.0f;
+	int i = 0;
+
+	// Gamma: a power per value is much slower than the rest of the pass, so it is read from a table instead.
+	// The table is kept for the next calls, which may resolve as little as a row of a tile
+	static thread_local vector<uint8_t> gamma_lut;
+	static thread_local float lut_gamma = 0.0f;
+	if (!linear && lut_gamma != settings.gamma)
+	{
+		gamma_lut.resize(GAMMA_LUT_SIZE);
+		for (int k = 0; k < GAMMA_LUT_SIZE; k++)
+			gamma_lut[k] = u8fromfloat(powf((float)k / (GAMMA_LUT_SIZE - 1), 1.0f / settings.gamma));
+		lut_gamma = settings.gamma;
+	}
+
+#ifdef USE_SSE2
+	__m128 scale4 = _mm_set1_ps(scale), one4 = _mm_set1_ps(1.0f), zero4 = _mm_setzero_ps();
+	__m128 quantize4 = _mm_set1_ps(linear ? 255.99f : (float)(GAMMA_LUT_SIZE - 1));
+
+	// 16 values per iteration: four registers scaled, tone mapped and clamped, then truncated to integers
+	for (; i + 16 <= num_values; i += 16)
+	{
+		__m128i q[4];
+
+		for (int k = 0; k < 4; k++)
+		{
+			__m128 x = _mm_mul_ps(_mm_loadu_ps(radiance + i + 4 * k), scale4);
+			if (tone_mapping)
+				x = _mm_div_ps(x, _mm_add_ps(one4, x));
+			x = _mm_min_ps(_mm_max_ps(x, zero4), one4); // maxps returns its second operand for NaN
+			q[k] = _mm_cvttps_epi32(_mm_mul_ps(x, quantize4));
+		}
+
+		if (linear)
+		{
+			// Values are in [0, 255]: the saturating packs keep them as they are
+			__m128i lo = _mm_packs_epi32(q[0], q[1]), hi = _mm_packs_epi32(q[2], q[3]);
+			_mm_storeu_si128((__m128i*)(pixels + i), _mm_packus_epi16(lo, hi));
+		}
+		else
+		{
+			alignas(16) int32_t index[16];
+			for (int k = 0; k < 4; k++)
+				_mm_store_si128((__m128i*)(index + 4 * k), q[k]);
+			for (int k = 0; k < 16; k++)
+				pixels[i + k] = gamma_lut[index[k]];
+		}
+	}
+#endif
+
+	for (; i < num_values; i++)
+	{
+		float x = displayValue(radiance[i], scale, tone_mapping);
+
+		if (linear)
+			pixels[i] = u8fromfloat(x);
+		else
+			pixels[i] = gamma_lut[(int)(x * (GAMMA_LUT_SIZE - 1))];
+	}
+}
@@ -0,0 +1,20 @@
+#ifndef RESOLVE_H
+#define RESOLVE_H
+
+#include <stdint.h>
+
+// Display settings applied by the resolve pass: exposure (in stops), optional Reinhard tone mapping and gamma.
+// The rendered radiance is never touched, so the image can be resolved again with other settings without tracing rays
+struct ResolveSettings {
+	float exposure;		// the radiance is scaled by 2^exposure
+	bool tone_mapping;	// x / (1 + x) instead of clipping at 1
+	float gamma;		// 1: linear output, 2.2: usual display
+
+	ResolveSettings() : exposure(0.0f), tone_mapping(false), gamma(1.0f) {}
+};
+
+// Converts num_values float channels to bytes. With the default settings the bytes are the clamped radiance,
+// as u8fromfloat(color.clamp()) used to give
+void resolveImage(const float* radiance, uint8_t* pixels, int num_values, const ResolveSettings& settings);
+
+#endif
@@ -5,15 +5,16 @@
 
 #include "maths.h"
 #include "scene.h"
+#include "instance.h"
 #include "macros.h"
 
 
-Triangle::Triangle(Vector& P0, Vector& P1, Vector& P2)
+Triangle::Triangle(Vector& P0, Vector& P1, Vector& P2, int a_index) : index(a_index)
 {
-	points[0] = P0; points[1] = P1; points[2] = P2;
+	vertex0 = P0; edge1 = P1 - P0; edge2 = P2 - P0;
 
 	/* Calculate the normal */
-	normal = (P1 - P0) % (P2 - P0);
+	normal = edge1 % edge2;
 	normal.normalize();
 
 	//YOUR CODE to Calculate the Min and Max for bounding box
@@ -33,64 +34,100 @@ Triangle::Triangle(Vector& P0, Vector& P1, Vector& P2)
 	Max += EPSILON;
 }
 
+void Triangle::Translate(Vector offset) {
+	vertex0 = vertex0 + offset;
+	Min = Min + offset;
+	Max = Max + offset;
+}
+
 AABB Triangle::GetBoundingBox() {
 	return(AABB(Min, Max));
 }
 
-Vector Triangle::getNormal(Vector point)
-{
-	return normal;
-}
+// The triangle is clipped by the six planes of the box in turn (Sutherland-Hodgman), and the polygon left is bounded.
+// A long thin triangle crossing the box diagonally is then bounded much more tightly than by its box cut down to the box
+AABB Triangle::GetClippedBoundingBox(const AABB& box) {
+	Vector polygon[9], clipped[9];	// each plane adds a vertex at most
+	int n = 3;
 
-//
-// Ray/Triangle intersection test using Tomas Moller-Ben Trumbore algorithm.
-//
+	polygon[0] = vertex0; polygon[1] = vertex0 + edge1; polygon[2] = vertex0 + edge2;
 
-bool Triangle::intercepts(Ray& r, float& t ) {
+	for (int plane = 0; plane < 6 && n > 0; plane++) {
+		int axis = plane % 3;
+		float bound = plane < 3 ? box.min.getAxisValue(axis) : box.max.getAxisValue(axis);
+		float side = plane < 3 ? 1.0f : -1.0f;	// positive inside the box
+		int m = 0;
 
-	r.direction.normalize();
+		for (int i = 0; i < n; i++) {
+			Vector& a = polygon[i];
+			Vector& b = polygon[(i + 1) % n];
+			float da = (a.getAxisValue(axis) - bound) * side, db = (b.getAxisValue(axis) - bound) * side;
 
-	//reference: scratch a pixel
-	//any point works
-	//TODO: CAN THIS BE DONE LIKE THIS?
-	
-	float vd = r.direction * normal;
+			if (da >= 0)
+				clipped[m++] = a;
+			if ((da < 0 && db > 0) || (da > 0 && db < 0)) {
+				Vector p = a + (b - a) * (da / (da - db));
 
-	//ray is parallel to triangle
-	if (vd == 0)
-		return false;
+				p.setAxisValue(axis, bound);
+				clipped[m++] = p;
+			}
+		}
 
-	float D = -(normal * points[0]);
-	float v0 = -(normal * r.origin + D);
-	
-	t = v0 / vd;
+		n = m;
+		for (int i = 0; i < n; i++)
+			polygon[i] = clipped[i];
+	}
+
+	// Nothing left (the triangle only grazes the box): fall back to the box cut down to it
+	if (n == 0)
+		return Object::GetClippedBoundingBox(box);
+
+	AABB bbox = AABB(polygon[0], polygon[0]);
+	for (int i = 1; i < n; i++)
+		bbox.extend(AABB(polygon[i], polygon[i]));
+
+	// enlarged as the whole triangle box is, but still within the box
+	bbox.min -= EPSILON;
+	bbox.max += EPSILON;
+	bbox.clip(box);
+	return bbox;
+}
 
-	if (t < 0)
+bool Triangle::intersect(const Ray& r, float tmax, HitRecord& hit)
+{
+	float t;
+
+	if (!intercepts(r, t) || t >= tmax)
 		return false;
 
-	Vector P = r.origin + r.direction * t;
-	Vector C; //perpendicular to triangle
+	hit.t = t;
+	hit.normal = normal;
+	hit.object = this;
+	hit.prim_id = index;
+	return true;
+}
 
-	//In case any error happens check edge directions are correct
-	// edge 0
-	Vector edge0 = points[1] - points[0];
-	Vector vp0 = P - points[0];
-	C = edge0%vp0;
-	if (normal * C < 0) return false;
+//
+// Ray/Triangle intersection test using Tomas Moller-Ben Trumbore algorithm.
+//
+
+// The edges from the first vertex are kept by the triangle, so the test needs neither its plane nor a square root.
+// All the conditions are worked out and combined without branches: most rays miss, and their branches would mispredict
+bool Triangle::intercepts(const Ray& r, float& t ) {
 
-	// edge 1
-	Vector edge1 = points[2] - points[1];
-	Vector vp1 = P - points[1];
-	C = edge1%vp1;
-	if (normal * C < 0)  return false;
+	Vector pvec = r.direction % edge2;
+	float det = edge1 * pvec;	// 0 if the ray is parallel to the triangle
+	float inv_det = 1.0f / det;
 
-	// edge 2
-	Vector edge2 = points[0] - points[2];
-	Vector vp2 = P - points[2];
-	C = edge2%vp2;
-	if (normal * C < 0) return false;
+	Vector tvec = r.origin - vertex0;
+	Vector qvec = tvec % edge1;
 
-	return true; // this ray hits the triangle
+	// Barycentric coordinates of the hit point (of vertex1 and vertex2), and its distance
+	float u = (tvec * pvec) * inv_det;
+	float v = (r.direction * qvec) * inv_det;
+	t = (edge2 * qvec) * inv_det;
+
+	return (det != 0) & (u >= 0) & (v >= 0) & (u + v <= 1) & (t >= 0); // this ray hits the triangle
 }
 
 Plane::Plane(Vector& a_PN, float a_D)
@@ -121,10 +158,8 @@ Plane::Plane(Vector& P0, Vector& P1, Vector& P2)
 // Ray/Plane intersection test.
 //
 
-bool Plane::intercepts( Ray& r, float& t )
+bool Plane::intercepts( const Ray& r, float& t )
 {
-	r.direction.normalize();
-
 	// A plane is defined by the equation: Ax + By + Cz + D = 0, or the vector [A B C D].
 	// A, B, and C, define the normal to the plane, Pn = [A B C].
 	// the distance from the origin [0 0 0] to the plane is D.
@@ -148,19 +183,23 @@ Vector Plane::getNormal(Vector point)
   return PN;
 }
 
-
-bool Sphere::intercepts(Ray& r, float& t )
+void Plane::Translate(Vector offset)
 {
-	r.direction.normalize();
+  points[0] = points[0] + offset; points[1] = points[1] + offset; points[2] = points[2] + offset;
+  D -= PN * offset;
+}
+
 
+bool Sphere::intercepts(const Ray& r, float& t )
+{
     Vector oc = center - r.origin;
     float b = r.direction * oc;
-    float c = pow(oc.length(), 2) - SqRadius;
+    float c = oc * oc - SqRadius;
 	
 	if (c > 0 && b <= 0)
 		return false;
 
-    float delta = pow(b, 2) - c;
+    float delta = b * b - c;
 
     if (delta <= 0)
         return false;
@@ -178,6 +217,10 @@ Vector Sphere::getNormal( Vector point )
 	return (normal.normalize());
 }
 
+void Sphere::Translate(Vector offset) {
+	center = center + offset;
+}
+
 AABB Sphere::GetBoundingBox() {
 	Vector a_min = Vector(center.x - radius, center.y - radius, center.z - radius);
 	Vector a_max = Vector(center.x + radius, center.y + radius, center.z + radius);
@@ -190,93 +233,66 @@ aaBox::aaBox(Vector& minPoint, Vector& maxPoint) //Axis aligned Box: another geo
 	this->max = maxPoint;
 }
 
+void aaBox::Translate(Vector offset) {
+	min = min + offset;
+	max = max + offset;
+}
+
 AABB aaBox::GetBoundingBox() {
 	return(AABB(min, max));
 }
 
-bool aaBox::intercepts(Ray& ray, float& t)
+bool aaBox::intercepts(const Ray& ray, float& t, int& axis)
 {
-	ray.direction.normalize();
-
 	//tirado dos slides (?)
-	double tx_min = 0, ty_min = 0, tz_min = 0;
-	double tx_max = 0, ty_max = 0, tz_max = 0;
+	//the sign of the direction tells which side of each slab is entered first
+	const Vector* bounds[2] = { &min, &max };
 
-	double a = 1.0 / ray.direction.x;
-
-	if (a >= 0) {
-		tx_min = (min.x - ray.origin.x) * a;
-		tx_max = (max.x - ray.origin.x) * a;
-	}
-	else {
-		tx_min = (max.x - ray.origin.x) * a;
-		tx_max = (min.x - ray.origin.x) * a;
-	}
-
-	double b = 1.0 / ray.direction.y;
-	if (b >= 0) {
-		ty_min = (min.y - ray.origin.y) * b;
-		ty_max = (max.y - ray.origin.y) * b;
-	}
-	else {
-		ty_min = (max.y - ray.origin.y) * b;
-		ty_max = (min.y - ray.origin.y) * b;
-	}
-
-	double c = 1.0 / ray.direction.z;
-	if (c >= 0) {
-		tz_min = (min.z - ray.origin.z) * c;
-		tz_max = (max.z - ray.origin.z) * c;
-	}
-	else {
-		tz_min = (max.z - ray.origin.z) * c;
-		tz_max = (min.z - ray.origin.z) * c;
-	}
+	float tx_min = (bounds[ray.sign[0]]->x - ray.origin.x) * ray.inv_dir.x;
+	float tx_max = (bounds[1 - ray.sign[0]]->x - ray.origin.x) * ray.inv_dir.x;
+	float ty_min = (bounds[ray.sign[1]]->y - ray.origin.y) * ray.inv_dir.y;
+	float ty_max = (bounds[1 - ray.sign[1]]->y - ray.origin.y) * ray.inv_dir.y;
+	float tz_min = (bounds[ray.sign[2]]->z - ray.origin.z) * ray.inv_dir.z;
+	float tz_max = (bounds[1 - ray.sign[2]]->z - ray.origin.z) * ray.inv_dir.z;
 
 
 	float tE, tL; //entering and leaving t values 
-	Vector face_in, face_out; // normals
+	int axis_E, axis_L; //slabs they come from
 	// find largest tE, entering t value
 
 	if (tx_min > ty_min) {
-		tE = tx_min;
-		face_in = (a >= 0.0) ? Vector(-1, 0, 0) : Vector(1, 0, 0);
+		tE = tx_min; axis_E = 0;
 	}
 	else {
-		tE = ty_min;
-		face_in = (b >= 0.0) ? Vector(0, -1, 0) : Vector(0, 1, 0);
+		tE = ty_min; axis_E = 1;
 	}
 
 	if (tz_min > tE) {
-		tE = tz_min;
-		face_in = (c >= 0.0) ? Vector(0, 0, -1) : Vector(0, 0, 1);
+		tE = tz_min; axis_E = 2;
 	}
 
 
 	// find smallest tL, leaving t value
 	if (tx_max < ty_max) {
-		tL = tx_max;
-		face_out = (a >= 0.0) ? Vector(1, 0, 0) : Vector(-1, 0, 0);
+		tL = tx_max; axis_L = 0;
 	}
 	else {
-		tL = ty_max;
-		face_out = (b >= 0.0) ? Vector(0, 1, 0) : Vector(0, -1, 0);
+		tL = ty_max; axis_L = 1;
 	}
 
 	if (tz_max < tL) {
-		tL = tz_max;
-		face_out = (c >= 0.0) ? Vector(0, 0, 1) : Vector(0, 0, -1);
+		tL = tz_max; axis_L = 2;
 	}
 	//printf("tE = %f, tL = %f\n", tE, tL);
 
-	if (tE < tL && tL > 0) { // condition for a hit
+	if (tE < tL && tL > ray.tmin) { // condition for a hit
 		if (tE > 0) {
 			t = tE; // ray hits outside surface
-			Normal = face_in;
+			axis = axis_E;
 		}
 		else {
 			t = tL; // ray hits inside surface
-			Normal = face_out;
+			axis = axis_L + 3;
 		}
 
 		return true;
@@ -285,27 +301,133 @@ bool aaBox::intercepts(Ray& ray, float& t)
 	return false;
 }
 
-Vector aaBox::getNormal(Vector point)
+// The normal of the face is worked out here rather than kept by the box, as other rays (maybe in other threads)
+// may hit it in between
+bool aaBox::intersect(const Ray& r, float tmax, HitRecord& hit)
 {
-	return Normal;
+	float t;
+	int axis;
+
+	if (!intercepts(r, t, axis) || t >= tmax)
+		return false;
+
+	// The ray enters a slab by its min side when it heads towards +axis, and leaves it by its max side
+	bool leaving = axis >= 3;
+	axis %= 3;
+	float sign = (r.sign[axis] == 1) != leaving ? 1.0f : -1.0f;
+
+	hit.t = t;
+	hit.normal = Vector(axis == 0 ? sign : 0, axis == 1 ? sign : 0, axis == 2 ? sign : 0);
+	hit.object = this;
+	hit.prim_id = -1;
+	return true;
 }
 
-Vector Object::getShadingNormal(Vector incident, Vector point) {
-	Vector normal = getNormal(point);
-	return incident * normal > 0 ? normal : normal * (-1);
+bool Object::intersect(const Ray& r, float tmax, HitRecord& hit) {
+	float t;
+
+	if (!intercepts(r, t) || t >= tmax)
+		return false;
+
+	hit.t = t;
+	hit.normal = getNormal(r.origin + r.direction * t);
+	hit.object = this;
+	hit.prim_id = -1;
+	return true;
 }
 
-Scene::Scene()
-{}
+bool Object::occluded(const Ray& r, float tmax) {
+	float t;
+
+	return intercepts(r, t) && t < tmax;
+}
+
+// Instead of moving the object, the ray is moved back by the displacement of the object
+bool Object::closestHit(const Ray& r, float tmax, HitRecord& hit) {
+	if (r.time == 0 || (velocity.x == 0 && velocity.y == 0 && velocity.z == 0))
+		return intersect(r, tmax, hit);
+
+	Ray moved = r;  // same direction, so its reciprocal is kept
+
+	moved.origin = r.origin - velocity * r.time;
+	return intersect(moved, tmax, hit);
+}
+
+bool Object::anyHit(const Ray& r, float tmax) {
+	if (r.time == 0 || (velocity.x == 0 && velocity.y == 0 && velocity.z == 0))
+		return occluded(r, tmax);
+
+	Ray moved = r;
+
+	moved.origin = r.origin - velocity * r.time;
+	return occluded(moved, tmax);
+}
+
+AABB Object::GetBoundingBox(float time) {
+	AABB bbox = GetBoundingBox();
+	Vector displacement = velocity * time;
+
+	bbox.min = bbox.min + displacement;
+	bbox.max = bbox.max + displacement;
+	return bbox;
+}
+
+AABB Object::GetSweptBoundingBox(float shutter) {
+	AABB bbox = GetBoundingBox();
+
+	bbox.extend(GetBoundingBox(shutter));
+	return bbox;
+}
+
+// Only a triangle knows how little of it is inside a box; other objects are bounded by their box cut down to it
+AABB Object::GetClippedBoundingBox(const AABB& box) {
+	AABB bbox = GetBoundingBox();
+
+	bbox.clip(box);
+	return bbox;
+}
+
+void Object::SetTime(float t) {
+	Vector new_offset = velocity * t;
+
+	Translate(new_offset - offset);
+	offset = new_offset;
+}
+
+// Identical materials have identical bytes (see Material::operator==), so their bytes are their key
+static string materialKey(const Material& m)
+{
+	return string((const char*)&m, sizeof(Material));
+}
 
+Scene::Scene() : materials(1)
+{
+	material_index[materialKey(materials[0])] = 0;
+}
+
+// Everything the scene created goes away with its arena
 Scene::~Scene()
 {
-	/*for ( int i = 0; i < objects.size(); i++ )
+	WaitSkybox();
+}
+
+uint16_t Scene::AddMaterial(const Material& m)
+{
+	string key = materialKey(m);
+	auto found = material_index.find(key);
+
+	if (found != material_index.end())
+		return found->second;
+
+	if (materials.size() > UINT16_MAX)
 	{
-		delete objects[i];
+		cerr << "Too many materials: the default one is used instead.\n";
+		return 0;
 	}
-	objects.erase();
-	*/
+
+	material_index[key] = (uint16_t)materials.size();
+	materials.push_back(m);
+	return (uint16_t)(materials.size() - 1);
 }
 
 int Scene::getNumObjects()
@@ -347,14 +469,27 @@ Light* Scene::getLight(unsigned int index)
 	return NULL;
 }
 
+void Scene::SetTime(float t)
+{
+	for (Object* object : objects)
+		object->SetTime(t);
+}
+
+// DevIL keeps a global state, so the faces are decoded one after the other,
+// but on their own thread, while the rest of the P3F file is parsed
 void Scene::LoadSkybox(const char *sky_dir)
+{
+	skybox_decoding = async(launch::async, &Scene::DecodeSkybox, this, string(sky_dir));
+}
+
+void Scene::DecodeSkybox(string sky_dir)
 {
 	char *filenames[6];
 	char buffer[100];
 	const char *maps[] = { "/right.jpg", "/left.jpg", "/top.jpg", "/bottom.jpg", "/front.jpg", "/back.jpg" };
 
 	for (int i = 0; i < 6; i++) {
-		strcpy_s(buffer, sizeof(buffer), sky_dir);
+		strcpy_s(buffer, sizeof(buffer), sky_dir.c_str());
 		strcat_s(buffer, sizeof(buffer), maps[i]);
 		filenames[i] = (char *)malloc(sizeof(buffer));
 		strcpy_s(filenames[i], sizeof(buffer), buffer);
@@ -395,6 +530,43 @@ void Scene::LoadSkybox(const char *sky_dir)
 		ilDeleteImages(1, &ImageName);
 	}
 	ilDisable(IL_ORIGIN_SET);
+
+	for (int i = 0; i < 6; i++)
+		free(filenames[i]);
+}
+
+// Converts the skybox faces into float textures, filtered for the footprint of a pixel of the camera.
+// Runs in the background (the faces in parallel), so that it overlaps with the acceleration structure build
+void Scene::BuildSkybox()
+{
+	skybox_building = async(launch::async, [this]() {
+		skybox_decoding.get();
+
+		// A face spans 90 degrees; a pixel spans the vertical field of view over the vertical resolution
+		float pixel_angle = (camera->GetFov() * PI / 180) / camera->GetResY();
+		float texel_angle = (PI / 2) / skybox_img[0].resX;
+
+		skybox_level = MAX(0, (int)floor(log2(pixel_angle / texel_angle) + 0.5f));
+
+		future<void> faces[6];
+		for (int i = 0; i < 6; i++) {
+			faces[i] = async(launch::async, [this, i]() {
+				skybox_tex[i].Build(skybox_img[i].img, skybox_img[i].resX, skybox_img[i].resY, skybox_img[i].BPP, skybox_level);
+				free(skybox_img[i].img);
+				skybox_img[i].img = NULL;
+			});
+		}
+		for (int i = 0; i < 6; i++)
+			faces[i].get();
+
+		printf("Skybox filtered at mip level %d.\n", skybox_level);
+	});
+}
+
+void Scene::WaitSkybox()
+{
+	if (skybox_building.valid())
+		skybox_building.get();
 }
 
 Color Scene::GetSkyboxColor(Ray& r) {
@@ -404,7 +576,6 @@ Color Scene::GetSkyboxColor(Ray& r) {
 	float ma;
 	CubeMap img_side;
 	float sc, tc, s, t;
-	unsigned int xp, yp, width, height, bytesperpixel;
 
 	//skybox indexed by the ray direction
 	cubemap_coords = r.direction;
@@ -461,20 +632,7 @@ Color Scene::GetSkyboxColor(Ray& r) {
 	s = (sc * invMa + 1) / 2;
 	t = (tc * invMa + 1) / 2;
 
-	width = skybox_img[img_side].resX;
-	height = skybox_img[img_side].resY;
-	bytesperpixel = skybox_img[img_side].BPP;
-
-	xp = int((width - 1) * s);
-	xp < 0 ? 0 : (xp > (width - 1) ? width - 1 : xp);
-	yp = int((height - 1) * t);
-	yp < 0 ? 0 : (yp > (height - 1) ? height - 1 : yp);
-
-	float red = u8tofloat(skybox_img[img_side].img[(yp*width + xp) * bytesperpixel]);
-	float green = u8tofloat(skybox_img[img_side].img[(yp*width + xp) * bytesperpixel + 1]);
-	float blue = u8tofloat(skybox_img[img_side].img[(yp*width + xp) * bytesperpixel + 2]);
-
-	return(Color(red, green, blue));
+	return skybox_tex[img_side].Bilinear(s, t);
 }
 
 
@@ -490,15 +648,47 @@ void next_token(ifstream& file, char *token, const char *name)
     cerr << "'" << name << "' expected.\n";
 }
 
+// Triangles of a "mesh" command: numbers of vertices and faces, the vertices, then the faces
+// as triples of vertex indices (from 1, or negative from the end)
+void read_mesh(ifstream& file, vector<Object*>& triangles, Arena& arena)
+{
+	unsigned total_vertices, total_faces;
+	unsigned P0, P1, P2;
+	vector<Vector> verticesArray;
+	Vector vertex;
+
+	file >> total_vertices >> total_faces;
+	verticesArray.reserve(total_vertices);
+	for (int i = 0; i < total_vertices; i++) {
+		file >> vertex;
+		verticesArray.push_back(vertex);
+	}
+	for (int i = 0; i < total_faces; i++) {
+		file >> P0 >> P1 >> P2;
+		if (P0 > 0) {
+			P0 -= 1;
+			P1 -= 1;
+			P2 -= 1;
+		}
+		else {
+			P0 += total_vertices;
+			P1 += total_vertices;
+			P2 += total_vertices;
+		}
+		triangles.push_back(arena.New<Triangle>(verticesArray[P0], verticesArray[P1], verticesArray[P2], (int)triangles.size())); //vertex index start at 1
+	}
+}
+
 bool Scene::load_p3f(const char *name)
 {
   const	int	lineSize = 1024;
   string	cmd;
   char		token	[256];
   ifstream	file(name, ios::in);
-  Material *	material;
+  uint16_t	material;
+  Vector	velocity = Vector(0, 0, 0);
 
-  material = NULL;
+  material = 0;
 
   if (file >> cmd)
   {
@@ -517,6 +707,30 @@ bool Scene::load_p3f(const char *name)
 		  file >> spp;
 		  this->SetSamplesPerPixel(spp);
 	  }
+	  else if (cmd == "depth")    //maximum number of bounces
+	  {
+		  int depth;
+
+		  file >> depth;
+		  this->SetMaxDepth(depth);
+	  }
+	  else if (cmd == "lightbvh")    //number of lights sampled per shading point
+	  {
+		  unsigned int n;
+
+		  file >> n;
+		  this->SetLightsPerPoint(n);
+	  }
+	  else if (cmd == "velocity")    //displacement per frame of the objects that follow
+	  {
+		  file >> velocity;
+		  if (velocity.length() > 0)
+			  has_motion = true;
+	  }
+	  else if (cmd == "shutter")    //motion blur: time the shutter stays open, in frames
+	  {
+		  file >> shutter;
+	  }
 	  else if (cmd == "f")   //Material
       {
 	    double Kd, Ks, Shine, T, ior, roughness;
@@ -524,7 +738,7 @@ bool Scene::load_p3f(const char *name)
 
 	    file >> cd >> Kd >> cs >> Ks >> Shine >> T >> ior >> roughness;
 
-	    material = new Material(cd, Kd, cs, Ks, Shine, T, ior, roughness);
+	    material = AddMaterial(Material(cd, Kd, cs, Ks, Shine, T, ior, roughness));
       }
 
       else if (cmd == "s")    //Sphere
@@ -534,8 +748,9 @@ bool Scene::load_p3f(const char *name)
          Sphere* sphere;
 
 	    file >> center >> radius;
-        sphere = new Sphere(center,radius);
-	    if (material) sphere->SetMaterial(material);
+        sphere = arena.New<Sphere>(center,radius);
+	    sphere->SetMaterial(material);
+	    sphere->SetVelocity(velocity);
         this->addObject( (Object*) sphere);
       }
 
@@ -545,8 +760,9 @@ bool Scene::load_p3f(const char *name)
 		  aaBox	*box;
 
 		  file >> minpoint >> maxpoint;
-		  box = new aaBox(minpoint, maxpoint);
-		  if (material) box->SetMaterial(material);
+		  box = arena.New<aaBox>(minpoint, maxpoint);
+		  box->SetMaterial(material);
+		  box->SetVelocity(velocity);
 		  this->addObject((Object*)box);
 	  }
 	  else if (cmd == "p")  // Polygon: just accepts triangles for now
@@ -559,8 +775,9 @@ bool Scene::load_p3f(const char *name)
 		  if (total_vertices == 3)
 		  {
 			  file >> P0 >> P1 >> P2;
-			  triangle = new Triangle(P0, P1, P2);
-			  if (material) triangle->SetMaterial(material);
+			  triangle = arena.New<Triangle>(P0, P1, P2, -1);
+			  triangle->SetMaterial(material);
+			  triangle->SetVelocity(velocity);
 			  this->addObject( (Object*) triangle);
 		  }
 		  else
@@ -571,34 +788,58 @@ bool Scene::load_p3f(const char *name)
       }
       
 	  else if (cmd == "mesh") {
-		  unsigned total_vertices, total_faces;
-		  unsigned P0, P1, P2;
-		  Triangle* triangle;
-		  Vector* verticesArray, vertex;
+		  vector<Object*> triangles;
 
-		  file >> total_vertices >> total_faces;
-		  verticesArray = (Vector*)malloc(total_vertices * sizeof(Vector));
-		  for (int i = 0; i < total_vertices; i++) {
-			  file >> vertex;
-			  verticesArray[i] = vertex;
+		  read_mesh(file, triangles, arena);
+		  for (Object* triangle : triangles) {
+			  triangle->SetMaterial(material);
+			  triangle->SetVelocity(velocity);
+			  this->addObject(triangle);
 		  }
-		  for (int i = 0; i < total_faces; i++) {
-			  file >> P0 >> P1 >> P2;
-			  if (P0 > 0) {
-				  P0 -= 1;
-				  P1 -= 1;
-				  P2 -= 1;
-			  }
-			  else {
-				  P0 += total_vertices;
-				  P1 += total_vertices;
-				  P2 += total_vertices;
-			  }
-			  triangle = new Triangle(verticesArray[P0], verticesArray[P1], verticesArray[P2]); //vertex index start at 1
-			  if (material) triangle->SetMaterial(material);
-			  this->addObject((Object*)triangle);
+	  }
+
+	  else if (cmd == "meshdef")  //meshdef <name> <P3F file>: the meshes of the file, to be instanced
+	  {
+		  string mesh_name, mesh_file;
+
+		  file >> mesh_name >> mesh_file;
+
+		  // The file is looked up next to the scene file
+		  string scene_path = name;
+		  size_t slash = scene_path.find_last_of("/\\");
+		  if (slash != string::npos)
+			  mesh_file = scene_path.substr(0, slash + 1) + mesh_file;
+
+		  Mesh* mesh = arena.New<Mesh>();
+		  if (!mesh->Load(mesh_file.c_str(), arena))
+			  break;
+		  meshes[mesh_name] = mesh;
+	  }
+
+	  else if (cmd == "instance")  //instance <name> scale <s> rotate <x y z> translate <x y z>: a mesh defined by meshdef
+	  {
+		  string mesh_name;
+		  float scale;
+		  Vector rotation, translation;
+
+		  file >> mesh_name;
+		  next_token(file, token, "scale");
+		  file >> scale;
+		  next_token(file, token, "rotate");
+		  file >> rotation;
+		  next_token(file, token, "translate");
+		  file >> translation;
+
+		  if (meshes.find(mesh_name) == meshes.end())
+		  {
+			  cerr << "Undefined mesh '" << mesh_name << "'.\n";
+			  break;
 		  }
 
+		  MeshInstance* instance = arena.New<MeshInstance>(meshes[mesh_name], scale, rotation, translation);
+		  instance->SetMaterial(material);
+		  instance->SetVelocity(velocity);
+		  this->addObject(instance);
 	  }
 
 	  else if (cmd == "pl")  // General Plane
@@ -607,8 +848,9 @@ bool Scene::load_p3f(const char *name)
 		  Plane* plane;
 
           file >> P0 >> P1 >> P2;
-          plane = new Plane(P0, P1, P2);
-	      if (material) plane->SetMaterial(material);
+          plane = arena.New<Plane>(P0, P1, P2);
+	      plane->SetMaterial(material);
+	      plane->SetVelocity(velocity);
           this->addObject( (Object*) plane);
 	  }
 
@@ -625,7 +867,7 @@ bool Scene::load_p3f(const char *name)
 			spl = this->GetSamplesPerPixel();
 		}
 	    
-	    this->addLight(new Light(pos, width, height, spl, color));
+	    this->addLight(arena.New<Light>(pos, width, height, spl, color));
 	    
       }
       else if (cmd == "v")
@@ -661,7 +903,7 @@ bool Scene::load_p3f(const char *name)
 		next_token(file, token, "focal");
 		file >> focal_ratio;
 	    // Create Camera
-		camera = new Camera( from, at, up, fov, hither, 100.0*hither, xres, yres, aperture_ratio, focal_ratio);
+		camera = arena.New<Camera>( from, at, up, fov, hither, 100.0*hither, xres, yres, aperture_ratio, focal_ratio);
         this->SetCamera(camera);
       }
 
@@ -694,16 +936,21 @@ bool Scene::load_p3f(const char *name)
   }
 
   file.close();
+
+  //the camera may come after the skybox in the file
+  if (this->GetSkyBoxFlg())
+	  this->BuildSkybox();
+
   return true;
 };
 
 void Scene::create_random_scene() {
 	Camera* camera;
-	Material* material;
+	uint16_t material;
 	Sphere* sphere;
 
 	set_rand_seed(time(NULL) * time(NULL) * time(NULL));
-	material = NULL;
+	material = 0;
 	this->SetSkyBoxFlg(false);  //init with no skybox
 
 	this->SetBackgroundColor(Color(0.5, 0.7, 1.0));
@@ -712,18 +959,18 @@ void Scene::create_random_scene() {
 	this->SetAccelStruct(BVH_ACC);
 	this->SetSamplesPerPixel(16);
 	
-	camera = new Camera(Vector(-5.312192, 4.456562, 11.963158), Vector(0.0, 0.0, 0), Vector(0.0, 1.0, 0.0), 45.0, 0.01, 10000.0, 512, 512, 0, 1.5f);
+	camera = arena.New<Camera>(Vector(-5.312192, 4.456562, 11.963158), Vector(0.0, 0.0, 0), Vector(0.0, 1.0, 0.0), 45.0, 0.01, 10000.0, 512, 512, 0, 1.5f);
 	this->SetCamera(camera);
 
-	this->addLight(new Light(Vector(7, 10, -5), 1, 1, 1, Color(1.0, 1.0, 1.0)));
-	this->addLight(new Light(Vector(-7, 10, -5), 1, 1, 1, Color(1.0, 1.0, 1.0)));
-	this->addLight(new Light(Vector(0, 10, 7), 1, 1, 1, Color(1.0, 1.0, 1.0)));
+	this->addLight(arena.New<Light>(Vector(7, 10, -5), 1, 1, 1, Color(1.0, 1.0, 1.0)));
+	this->addLight(arena.New<Light>(Vector(-7, 10, -5), 1, 1, 1, Color(1.0, 1.0, 1.0)));
+	this->addLight(arena.New<Light>(Vector(0, 10, 7), 1, 1, 1, Color(1.0, 1.0, 1.0)));
 
-	material = new Material(Color(0.5, 0.5, 0.5), 1.0, Color(0.0, 0.0, 0.0), 0.0, 10, 0, 1, 0);
+	material = AddMaterial(Material(Color(0.5, 0.5, 0.5), 1.0, Color(0.0, 0.0, 0.0), 0.0, 10, 0, 1, 0));
 
 
-	sphere = new Sphere(Vector(0.0, -1000, 0.0), 1000.0);
-	if (material) sphere->SetMaterial(material);
+	sphere = arena.New<Sphere>(Vector(0.0, -1000, 0.0), 1000.0);
+	sphere->SetMaterial(material);
 	this->addObject((Object*)sphere);
 
 	for (int a = -5; a < 5; a++)
@@ -735,21 +982,21 @@ void Scene::create_random_scene() {
 
 			if ((center - Vector(4.0, 0.2, 0.0)).length() > 0.9) {
 				if (choose_mat < 0.4) {  //diffuse
-					material = new Material(Color(rand_double(), rand_double(), rand_double()), 1.0, Color(0.0, 0.0, 0.0), 0.0, 10, 0, 1, 0);
-					sphere = new Sphere(center, 0.2);
-					if (material) sphere->SetMaterial(material);
+					material = AddMaterial(Material(Color(rand_double(), rand_double(), rand_double()), 1.0, Color(0.0, 0.0, 0.0), 0.0, 10, 0, 1, 0));
+					sphere = arena.New<Sphere>(center, 0.2);
+					sphere->SetMaterial(material);
 					this->addObject((Object*)sphere);
 				}
 				else if (choose_mat < 0.9) {   //metal
-					material = new Material(Color(0.0, 0.0, 0.0), 0.0, Color(rand_double(0.5, 1), rand_double(0.5, 1), rand_double(0.5, 1)), 1.0, 220, 0, 1, 0);
-					sphere = new Sphere(center, 0.2);
-					if (material) sphere->SetMaterial(material);
+					material = AddMaterial(Material(Color(0.0, 0.0, 0.0), 0.0, Color(rand_double(0.5, 1), rand_double(0.5, 1), rand_double(0.5, 1)), 1.0, 220, 0, 1, 0));
+					sphere = arena.New<Sphere>(center, 0.2);
+					sphere->SetMaterial(material);
 					this->addObject((Object*)sphere);
 				}
 				else {   //glass 
-					material = new Material(Color(0.0, 0.0, 0.0), 0.0, Color(1.0, 1.0, 1.0), 0.7, 20, 1, 1.5, 0);
-					sphere = new Sphere(center, 0.2);
-					if (material) sphere->SetMaterial(material);
+					material = AddMaterial(Material(Color(0.0, 0.0, 0.0), 0.0, Color(1.0, 1.0, 1.0), 0.7, 20, 1, 1.5, 0));
+					sphere = arena.New<Sphere>(center, 0.2);
+					sphere->SetMaterial(material);
 					this->addObject((Object*)sphere);
 				}
 
@@ -757,18 +1004,18 @@ void Scene::create_random_scene() {
 
 		}
 
-	material = new Material(Color(0.0, 0.0, 0.0), 0.0, Color(1.0, 1.0, 1.0), 0.7, 20, 1, 1.5, 0);
-	sphere = new Sphere(Vector(0.0, 1.0, 0.0), 1.0);
-	if (material) sphere->SetMaterial(material);
+	material = AddMaterial(Material(Color(0.0, 0.0, 0.0), 0.0, Color(1.0, 1.0, 1.0), 0.7, 20, 1, 1.5, 0));
+	sphere = arena.New<Sphere>(Vector(0.0, 1.0, 0.0), 1.0);
+	sphere->SetMaterial(material);
 	this->addObject((Object*)sphere);
 
-	material = new Material(Color(0.4, 0.2, 0.1), 0.9, Color(1.0, 1.0, 1.0), 0.1, 10, 0, 1.0, 0.5);
-	sphere = new Sphere(Vector(-4.0, 1.0, 0.0), 1.0);
-	if (material) sphere->SetMaterial(material);
+	material = AddMaterial(Material(Color(0.4, 0.2, 0.1), 0.9, Color(1.0, 1.0, 1.0), 0.1, 10, 0, 1.0, 0.5));
+	sphere = arena.New<Sphere>(Vector(-4.0, 1.0, 0.0), 1.0);
+	sphere->SetMaterial(material);
 	this->addObject((Object*)sphere);
 
-	material = new Material(Color(0.4, 0.2, 0.1), 0.0, Color(0.7, 0.6, 0.5), 1.0, 220, 0, 1.0, 0.5);
-	sphere = new Sphere(Vector(4.0, 1.0, 0.0), 1.0);
-	if (material) sphere->SetMaterial(material);
+	material = AddMaterial(Material(Color(0.4, 0.2, 0.1), 0.0, Color(0.7, 0.6, 0.5), 1.0, 220, 0, 1.0, 0.5));
+	sphere = arena.New<Sphere>(Vector(4.0, 1.0, 0.0), 1.0);
+	sphere->SetMaterial(material);
 	this->addObject((Object*)sphere);
 }
\ No newline at end of file
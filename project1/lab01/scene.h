@@ -6,6 +6,13 @@
 #include <IL/il.h>
 #include <algorithm>
 #include <random>
+#include <future>
+#include <mutex>
+#include <string>
+#include <string.h>
+#include <stdint.h>
+#include <map>
+#include <unordered_map>
 using namespace std;
 
 #include "camera.h"
@@ -13,13 +20,18 @@ using namespace std;
 #include "vector.h"
 #include "ray.h"
 #include "boundingBox.h"
+#include "texture.h"
+#include "arena.h"
+
+#define MAX_DEPTH 4 // default number of bounces
 
 //Type of acceleration structure
-typedef enum { NONE, GRID_ACC, BVH_ACC }  accelerator;
+typedef enum { NONE, GRID_ACC, BVH_ACC, KDTREE_ACC }  accelerator;
 
 //Skybox images constant symbolics
 typedef enum { RIGHT, LEFT, TOP, BOTTOM, FRONT, BACK } CubeMap;
 
+// Materials are values in the material table of the scene (Scene::AddMaterial), where objects refer to them by index
 class Material
 {
 public:
@@ -48,39 +60,61 @@ public:
 	void SetRefrIndex( float a_ior ) { m_RIndex = a_ior; }
 	float GetRefrIndex() { return m_RIndex; }
 	float GetRoughness() { return m_Roughness; }
+
+	// Only floats, without padding, so identical materials have identical bytes
+	bool operator==(const Material& m) const { return memcmp(this, &m, sizeof(Material)) == 0; }
+
 private:
-	Color m_diffColor, m_specColor;
+	// In the order shading reads them: diffuse, specular, then secondary rays
+	Color m_diffColor;
+	float m_Diff;
+	Color m_specColor;
+	float m_Spec, m_Shine;
 	float m_Refl, m_T;
-	float m_Diff, m_Shine, m_Spec;
 	float m_RIndex;
 	float m_Roughness;
 };
 
+// Order in which a thread takes the strata of an area light
+struct LightSampleSequence
+{
+	vector<int> strata;
+	int current = 0;
+};
+
 class Light
 {
 public:
 
-	Light( Vector& pos, int width, int height, int spl, Color& col): position(pos), width(width), height(height), spl(spl), color(col), current_sample(0)
+	Light( const Vector& pos, int width, int height, int spl, const Color& col): position(pos), width(width), height(height), spl(spl), color(col)
 	{
-		proccessed_samples = std::vector<int>(spl);
-		for (int i = 0; i < spl; i++) {
-			proccessed_samples[i] = i;
-		}
 	};
 
 	float getPointIntensity() {
 		return 1.0 / (spl);
 	}
 
+	// Jittered stratified samples: each thread takes the strata of the light in its own shuffled order, so threads
+	// never wait for each other and a pixel does not depend on what the other threads sampled
 	Vector getRandomLightPoint() {
-		
-		if (current_sample == 0) {
-			std::shuffle(std::begin(proccessed_samples), std::end(proccessed_samples), rd);
+		static thread_local unordered_map<const Light*, LightSampleSequence> sequences;
+		LightSampleSequence& sequence = sequences[this];
+
+		if ((int)sequence.strata.size() != spl) {
+			sequence.strata.resize(spl);
+			for (int i = 0; i < spl; i++)
+				sequence.strata[i] = i;
+			sequence.current = 0;
+		}
+
+		if (sequence.current == 0) {
+			for (int i = spl - 1; i > 0; i--)
+				swap(sequence.strata[i], sequence.strata[rand_int() % (i + 1)]);
 		}
 
-		int rand_sample_x = proccessed_samples[current_sample] % (int) sqrt(spl);
-		int rand_sample_z = proccessed_samples[current_sample] / (int) sqrt(spl);
-		current_sample = (current_sample + 1) % (spl);
+		int rand_sample_x = sequence.strata[sequence.current] % (int) sqrt(spl);
+		int rand_sample_z = sequence.strata[sequence.current] / (int) sqrt(spl);
+		sequence.current = (sequence.current + 1) % (spl);
 
 		float e = rand_float();
 
@@ -88,29 +122,69 @@ public:
 		return Vector(position.x + (rand_sample_x + e) * (width/sqrt(spl)), position.y, position.z + (rand_sample_z + e) * (height / sqrt(spl)));
 	}
 	
-	std::random_device rd;
-	std::vector<int> proccessed_samples;
-	int current_sample;
-	
 	Vector position;
 	int width, height, spl;
 	Color color;
 };
 
+// Point sampled on a light, as seen from a hit point
+struct LightSample {
+	Vector dir;			// from the hit point to the sample (not normalized)
+	float cos_theta;	// between the normalized dir and the shading normal
+	Color colour;		// light colour carried by this sample
+	bool visible = false;	// already known to be unoccluded, so no shadow ray is needed
+};
+
+class Object;
+
+// Closest hit found along a ray, with what shading needs of it, so that nothing is worked out again after the traversal
+struct HitRecord
+{
+	float t;			// distance along the ray
+	Vector normal;		// geometric normal, normalized; it may face away from the ray
+	Object* object;		// object of the scene that was hit: its material shades the hit
+	int prim_id;		// primitive hit within the object (triangle of the mesh of an instance), -1 if it is a single one
+
+	Vector getPoint(const Ray& r) const { return r.origin + r.direction * t; }
+	// The normal on the side the ray comes from (incident: reversed ray direction)
+	Vector getShadingNormal(const Vector& incident) const { return incident * normal > 0 ? normal : normal * (-1); }
+};
+
 class Object
 {
 public:
 
-	Material* GetMaterial() { return m_Material; }
-	void SetMaterial( Material *a_Mat ) { m_Material = a_Mat; }
-	virtual bool intercepts( Ray& r, float& dist ) = 0;
-	virtual Vector getNormal( Vector point ) = 0;
-	Vector getShadingNormal(Vector incident, Vector point);
+	uint16_t GetMaterial() { return m_Material; }  //index in the material table of the scene
+	void SetMaterial( uint16_t a_Mat ) { m_Material = a_Mat; }
 	virtual AABB GetBoundingBox() { return AABB(); }
 	Vector getCentroid(void) { return GetBoundingBox().centroid(); }
 
+	// Intersection entry points, only hits closer than tmax count. Motion blur: the object is seen by a ray
+	// traced time frames later (see Ray::time), while it keeps moving
+	bool closestHit(const Ray& r, float tmax, HitRecord& hit);	// fills hit
+	bool anyHit(const Ray& r, float tmax);	// shadow rays: only whether there is a hit
+	AABB GetBoundingBox(float time);
+	AABB GetSweptBoundingBox(float shutter);  //bounds the object while the shutter is open
+	virtual AABB GetClippedBoundingBox(const AABB& box);  //bounds the part of the object inside box (spatial splits of the BVH)
+
+	// Animation: the object moves at a constant velocity (per frame); SetTime places it where it is at time t (in frames)
+	void SetVelocity(Vector v) { velocity = v; }
+	Vector GetVelocity() { return velocity; }
+	void SetTime(float t);
+
 protected:
-	Material* m_Material;
+	virtual void Translate(Vector offset) {}
+
+	// Intersection tests of the object at rest. By default they are made of those of a single surface,
+	// intercepts() (distance to it) and getNormal(); objects made of other objects override them
+	virtual bool intersect(const Ray& r, float tmax, HitRecord& hit);
+	virtual bool occluded(const Ray& r, float tmax);
+	virtual bool intercepts(const Ray& r, float& dist) { return false; }
+	virtual Vector getNormal(Vector point) { return Vector(0, 0, 1); }
+
+	Vector velocity = Vector(0, 0, 0);
+	Vector offset = Vector(0, 0, 0);  // displacement from the position given in the scene file
+	uint16_t m_Material = 0;
 	
 };
 
@@ -125,21 +199,27 @@ public:
 		 Plane		(Vector& PNc, float Dc);
 		 Plane		(Vector& P0, Vector& P1, Vector& P2);
 
-		 bool intercepts( Ray& r, float& dist );
-         Vector getNormal(Vector point);
+protected:
+		 void Translate(Vector offset);
+		 bool intercepts( const Ray& r, float& dist );
+		 Vector getNormal(Vector point);
 };
 
 class Triangle : public Object
 {
 	
 public:
-	Triangle	(Vector& P0, Vector& P1, Vector& P2);
-	bool intercepts( Ray& r, float& t);
-	Vector getNormal(Vector point);
+	Triangle	(Vector& P0, Vector& P1, Vector& P2, int a_index);
 	AABB GetBoundingBox(void);
+	AABB GetClippedBoundingBox(const AABB& box);
 	
 protected:
-	Vector points[3];
+	void Translate(Vector offset);
+	bool intersect(const Ray& r, float tmax, HitRecord& hit);
+	bool intercepts( const Ray& r, float& t);
+
+	int index;	// in its mesh: the primitive id of its hits
+	Vector vertex0, edge1, edge2;	// Moller-Trumbore: the first vertex and the edges from it to the other two
 	Vector normal;
 	Vector Min, Max;
 };
@@ -148,14 +228,17 @@ protected:
 class Sphere : public Object
 {
 public:
-	Sphere( Vector& a_center, float a_radius ) : 
+	Sphere( const Vector& a_center, float a_radius ) : 
 		center( a_center ), SqRadius( a_radius * a_radius ), 
 		radius( a_radius ) {};
 
-	bool intercepts( Ray& r, float& t);
-	Vector getNormal(Vector point);
 	AABB GetBoundingBox(void);
 
+protected:
+	void Translate(Vector offset);
+	bool intercepts( const Ray& r, float& t);
+	Vector getNormal(Vector point);
+
 private:
 	Vector center;
 	float radius, SqRadius;
@@ -166,17 +249,22 @@ class aaBox : public Object   //Axis aligned box: another geometric object
 public:
 	aaBox(Vector& minPoint, Vector& maxPoint);
 	AABB GetBoundingBox(void);
-	bool intercepts(Ray& r, float& t);
-	Vector getNormal(Vector point);
+
+protected:
+	void Translate(Vector offset);
+	bool intersect(const Ray& r, float tmax, HitRecord& hit);  // the normal is the one of the slab the ray crosses at the hit
+	bool intercepts(const Ray& r, float& t) { int axis; return intercepts(r, t, axis); }
 
 private:
+	bool intercepts(const Ray& r, float& t, int& axis);  // axis: of the face hit, + 3 if the ray leaves through it (from inside)
+
 	Vector min;
 	Vector max;
-
-	Vector Normal;
 };
 
 
+class Mesh;
+
 class Scene
 {
 public:
@@ -188,14 +276,23 @@ public:
 	Color GetSkyboxColor(Ray& r);
 	bool GetSkyBoxFlg() { return SkyBoxFlg; }
 	unsigned int GetSamplesPerPixel() { return samples_per_pixel; }
+	int GetMaxDepth() { return max_depth; }
+	unsigned int GetLightsPerPoint() { return lights_per_point; }
 	accelerator GetAccelStruct() { return accel_struc_type; }
+	bool HasMotion() { return has_motion; }
+	float GetShutter() { return shutter; }
 	
 	void SetBackgroundColor(Color a_bgColor) { bgColor = a_bgColor; }
-	void LoadSkybox(const char*);
+	void LoadSkybox(const char*);  //starts decoding the faces in the background
+	void BuildSkybox();  //starts converting the faces in the background, once decoded
+	void WaitSkybox();  //the skybox can be looked up after this returns
 	void SetSkyBoxFlg(bool a_skybox_flg) { SkyBoxFlg = a_skybox_flg; }
 	void SetCamera(Camera *a_camera) {camera = a_camera; }
 	void SetAccelStruct(accelerator accel_t) { accel_struc_type = accel_t; }
 	void SetSamplesPerPixel(unsigned int spp) { samples_per_pixel = spp; }
+	void SetMaxDepth(int depth) { max_depth = depth; }
+	void SetLightsPerPoint(unsigned int n) { lights_per_point = n; }
+	void SetTime(float t);  //moves the objects to their position at time t (in frames)
 
 	int getNumObjects( );
 	void addObject( Object* o );
@@ -205,17 +302,29 @@ public:
 	void addLight( Light* l );
 	Light* getLight( unsigned int index );
 
+	uint16_t AddMaterial(const Material& m);  //index of the material in the table, shared by identical materials
+	Material* GetMaterial(uint16_t index) { return &materials[index]; }
+	int getNumMaterials() { return materials.size(); }
+
 	bool load_p3f(const char *name);  //Load NFF file method
 	void create_random_scene();
 	
 private:
+	Arena arena;  // objects, lights, camera and meshes: released with the scene
 	vector<Object *> objects;
 	vector<Light *> lights;
+	vector<Material> materials;  // deduplicated; materials[0] is the default one, of the objects given before any material
+	map<string, uint16_t> material_index;  // bytes of each material to its index, so deduplicating does not scan the table
+	map<string, Mesh*> meshes;  // defined by meshdef, shared by their instances
 
 	Camera* camera;
 	Color bgColor;  //Background color
 	unsigned int samples_per_pixel;  // samples per pixel
+	int max_depth = MAX_DEPTH;  // maximum number of bounces of a path
+	unsigned int lights_per_point = 0;  // lights sampled per shading point through the light BVH (0: all lights)
 	accelerator accel_struc_type;
+	bool has_motion = false;  // some object has a velocity
+	float shutter = 0;  // motion blur: time (in frames) the shutter stays open for each frame
 
 	bool SkyBoxFlg = false;
 
@@ -224,7 +333,13 @@ private:
 		unsigned int resX;
 		unsigned int resY;
 		unsigned int BPP; //bytes per pixel
-	} skybox_img[6];
+	} skybox_img[6];  //decoded faces, until BuildSkybox converts them
+
+	Texture skybox_tex[6];
+	int skybox_level = 0;  //mip level matching the footprint of a pixel
+
+	future<void> skybox_decoding, skybox_building;
+	void DecodeSkybox(string sky_dir);
 
 };
 
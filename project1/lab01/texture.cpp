@@ -0,0 +1,100 @@
+#include "texture.h"
+#include "maths.h"
+#include "macros.h"
+
+#ifdef USE_SSE
+#include <xmmintrin.h>
+#endif
+
+Texture::Texture(void) : width(0), height(0), tiles_x(0), level(0) {}
+
+void Texture::Build(unsigned char* img, int resX, int resY, int bpp, int level_) {
+	// Bytes are converted to float once, here, instead of at every lookup
+	vector<float> rows(resX * resY * 3);
+	for (int i = 0; i < resX * resY; i++) {
+		rows[i * 3] = u8tofloat(img[i * bpp]);
+		rows[i * 3 + 1] = u8tofloat(img[i * bpp + 1]);
+		rows[i * 3 + 2] = u8tofloat(img[i * bpp + 2]);
+	}
+
+	// Each level averages 2x2 texels of the previous one; only the last one is kept
+	width = resX;
+	height = resY;
+	for (level = 0; level < level_ && (width > 1 || height > 1); level++) {
+		int next_width = MAX(1, width / 2), next_height = MAX(1, height / 2);
+		vector<float> next(next_width * next_height * 3);
+
+		for (int y = 0; y < next_height; y++) {
+			for (int x = 0; x < next_width; x++) {
+				int x0 = MIN(2 * x, width - 1), x1 = MIN(2 * x + 1, width - 1);
+				int y0 = MIN(2 * y, height - 1), y1 = MIN(2 * y + 1, height - 1);
+
+				for (int c = 0; c < 3; c++)
+					next[(y * next_width + x) * 3 + c] = (rows[(y0 * width + x0) * 3 + c] + rows[(y0 * width + x1) * 3 + c] +
+						rows[(y1 * width + x0) * 3 + c] + rows[(y1 * width + x1) * 3 + c]) * 0.25f;
+			}
+		}
+
+		rows.swap(next);
+		width = next_width;
+		height = next_height;
+	}
+
+	// Tiles with their border, clamped at the edges of the image
+	tiles_x = (width + TEX_TILE - 1) / TEX_TILE;
+	int tiles_y = (height + TEX_TILE - 1) / TEX_TILE;
+	texels.assign(tiles_x * tiles_y * TILE_ROW * TILE_ROW * 3 + 1, 0.0f);  //one more float, read along with the last texel
+
+	for (int ty = 0; ty < tiles_y; ty++) {
+		for (int tx = 0; tx < tiles_x; tx++) {
+			float* tile = &texels[(ty * tiles_x + tx) * TILE_ROW * TILE_ROW * 3];
+
+			for (int j = 0; j < TILE_ROW; j++) {
+				for (int i = 0; i < TILE_ROW; i++) {
+					int x = MIN(tx * TEX_TILE + i, width - 1), y = MIN(ty * TEX_TILE + j, height - 1);
+
+					for (int c = 0; c < 3; c++)
+						tile[(j * TILE_ROW + i) * 3 + c] = rows[(y * width + x) * 3 + c];
+				}
+			}
+		}
+	}
+}
+
+Color Texture::Bilinear(float s, float t) {
+	// Texel i covers [i, i + 1[ / size, so its centre is at (i + 0.5) / size
+	float u = MAX(0.0f, MIN((float)(width - 1), s * width - 0.5f));
+	float v = MAX(0.0f, MIN((float)(height - 1), t * height - 0.5f));
+	int x0 = (int)u, y0 = (int)v;
+	float fx = u - x0, fy = v - y0;
+
+	// The other three texels are in the same tile, at fixed offsets
+	float* t00 = texel(x0, y0);
+	float* t10 = t00 + 3;
+	float* t01 = t00 + TILE_ROW * 3;
+	float* t11 = t01 + 3;
+
+#ifdef USE_SSE
+	// RGB and the next float of each texel in one register (levels are padded with a float at the end)
+	__m128 c00 = _mm_loadu_ps(t00), c10 = _mm_loadu_ps(t10);
+	__m128 c01 = _mm_loadu_ps(t01), c11 = _mm_loadu_ps(t11);
+	__m128 fx4 = _mm_set1_ps(fx), fy4 = _mm_set1_ps(fy);
+
+	__m128 bottom = _mm_add_ps(c00, _mm_mul_ps(_mm_sub_ps(c10, c00), fx4));
+	__m128 top = _mm_add_ps(c01, _mm_mul_ps(_mm_sub_ps(c11, c01), fx4));
+	__m128 rgb4 = _mm_add_ps(bottom, _mm_mul_ps(_mm_sub_ps(top, bottom), fy4));
+
+	alignas(16) float rgb[4];
+	_mm_store_ps(rgb, rgb4);
+#else
+	float rgb[3];
+
+	for (int c = 0; c < 3; c++) {
+		float bottom = t00[c] + (t10[c] - t00[c]) * fx;
+		float top = t01[c] + (t11[c] - t01[c]) * fx;
+		rgb[c] = bottom + (top - bottom) * fy;
+	}
+#endif
+
+	return Color(rgb[0], rgb[1], rgb[2]);
+}
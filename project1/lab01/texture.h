@@ -0,0 +1,39 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include <vector>
+#include "color.h"
+
+using namespace std;
+
+#define TEX_TILE 8 // side (in texels) of the square tiles the texels are stored in
+
+// RGB float image, box filtered down to one mip level. Texels are stored tile by tile, so that the four
+// texels of a bilinear lookup (and those of nearby lookups) share a few cache lines. Each tile also holds
+// a copy of the first column and row of its right and upper neighbours, so a lookup never crosses tiles
+class Texture
+{
+public:
+	Texture(void);
+
+	// img: rows of RGB(A) bytes, halved level times before being stored
+	void Build(unsigned char* img, int resX, int resY, int bpp, int level);
+	int getLevel() { return level; }
+
+	Color Bilinear(float s, float t);  // s, t in [0, 1]
+
+private:
+	static const int TILE_ROW = TEX_TILE + 1;	// texels per row of a stored tile, border included
+
+	float* texel(unsigned int x, unsigned int y) {
+		unsigned int tile = (y / TEX_TILE) * tiles_x + x / TEX_TILE;
+		return &texels[(tile * TILE_ROW * TILE_ROW + (y % TEX_TILE) * TILE_ROW + x % TEX_TILE) * 3];
+	}
+
+	int width, height;
+	int tiles_x;			// number of tiles per row
+	vector<float> texels;
+	int level;				// mip level of the stored texels
+};
+
+#endif
@@ -4,40 +4,59 @@
 #include <iostream>
 #include <cmath>
 #include <cfloat>
+#include "macros.h"
+
 using namespace std;
 
+// All the operators are inline, so that vectors can stay in registers across the hot loops.
 class Vector
 {
 public:
-	Vector(){};
-	Vector(float x, float y, float z);
-	Vector(const Vector& v);
-
-	float length();
-
-	float getAxisValue(int axis);
-
-	Vector&	normalize();
-	Vector operator=(const Vector& v);
-	Vector operator+( const Vector& v );
-	Vector operator-( const Vector& v );
-	Vector operator*( float f );
-	float  operator*(const Vector& v);   //inner product
-	Vector operator/( float f );
-	Vector operator%( const Vector& v); //external product
-	Vector&	operator-=	(const Vector& v);
-	Vector&	operator-=	(const float v);
-	Vector&	operator*=	(const float v);
-	Vector&	operator+=	(const float v);
+	Vector() = default;
+	constexpr Vector(float a_x, float a_y, float a_z) : x(a_x), y(a_y), z(a_z) {}
+
+	float length() const { return sqrt(x * x + y * y + z * z); }
+
+	constexpr float getAxisValue(int axis) const { return (axis == 0) ? x : (axis == 1) ? y : z; }
+	void setAxisValue(int axis, float value) { if (axis == 0) x = value; else if (axis == 1) y = value; else z = value; }
+
+	Vector& normalize()
+	{
+		if (length() == 1) return *this;
+		float l = 1.0 / length();
+		x *= l; y *= l; z *= l;
+		return *this;
+	}
+
+	constexpr Vector operator+(const Vector& v) const { return Vector(x + v.x, y + v.y, z + v.z); }
+	constexpr Vector operator-(const Vector& v) const { return Vector(x - v.x, y - v.y, z - v.z); }
+	constexpr Vector operator*(float f) const { return Vector(x * f, y * f, z * f); }
+	constexpr float  operator*(const Vector& v) const { return x * v.x + y * v.y + z * v.z; }   //inner product
+	constexpr Vector operator/(float f) const { return Vector(x / f, y / f, z / f); }
+	constexpr Vector operator%(const Vector& v) const	//external product
+	{
+		return Vector(y * v.z - z * v.y, z * v.x - x * v.z, x * v.y - y * v.x);
+	}
+
+	constexpr Vector& operator+=(const Vector& v) { x += v.x; y += v.y; z += v.z; return *this; }
+	constexpr Vector& operator-=(const Vector& v) { x -= v.x; y -= v.y; z -= v.z; return *this; }
+	constexpr Vector& operator-=(const float v) { x -= v; y -= v; z -= v; return *this; }
+	constexpr Vector& operator*=(const float v) { x *= v; y *= v; z *= v; return *this; }
+	constexpr Vector& operator+=(const float v) { x += v; y += v; z += v; return *this; }
 
 	float x;
 	float y;
 	float z;
 
-     friend inline
-  istream&	operator >>	(istream& s, Vector& v)
+	friend inline
+	istream& operator >> (istream& s, Vector& v)
 	{ return s >> v.x >> v.y >> v.z; }
-  
 };
 
-#endif
\ No newline at end of file
+// a * fa + b * fb + c * fc: a point given by its coordinates in a frame (camera rays, shading frames)
+inline Vector Combine(const Vector& a, float fa, const Vector& b, float fb, const Vector& c, float fc)
+{
+	return a * fa + b * fb + c * fc;
+}
+
+#endif